@@ -0,0 +1,350 @@
+#define TL_IMPL
+#include "filter.h"
+
+#include <tl/main.h>
+
+#include <string>
+
+// Benchmarks every registered filter on synthetic images and reports megapixels per second.
+// Results can be saved as json and compared against a saved baseline to catch regressions.
+
+struct BenchCase {
+    char const *filter;
+    char const *options;
+};
+
+// Radius and option grid. Filters missing here still run once with default options.
+BenchCase bench_cases[] = {
+    {"dilate", "radius 8 smooth false"},
+    {"dilate", "radius 32 smooth false"},
+    {"dilate", "radius 8 smooth false distance manhattan"},
+    {"dilate", "radius 8 smooth false distance chebyshev"},
+    {"dilate", "radius 8"},
+    {"dilate", "radius 32"},
+    {"dilate", "radius 32 method pushpull"},
+    {"median", "radius 1"},
+    {"median", "radius 2"},
+    {"median", "radius 5"},
+    {"median", "radius 8"},
+    {"median", "radius 32"},
+    {"bilateral", "radius 1"},
+    {"bilateral", "radius 2"},
+    {"bilateral", "radius 5"},
+    {"bilateral", "radius 8"},
+    {"bilateral", "radius 8 mode gaussian"},
+    {"bilateral", "radius 8 mode grid"},
+    {"bilateral", "radius 32 mode grid"},
+    {"kuwahara", "radius 1"},
+    {"kuwahara", "radius 2"},
+    {"kuwahara", "radius 5"},
+    {"kuwahara", "radius 8"},
+    {"kuwahara", "radius 32"},
+    {"skidmark", "slices 36"},
+    {"skidmark", "slices 36 sampling bilinear"},
+    {"erode", "radius 2"},
+    {"erode", "radius 32"},
+    {"erode", "radius 32 shape disk channel luma"},
+    {"maxfilter", "radius 32 shape disk channel rgba"},
+};
+
+// Smooth color gradients plus uniform noise of amplitude `noise`*255. Alpha is 255 on `coverage` of the
+// pixels, in blobs made from bilinearly interpolated random values on a 32 pixel grid.
+inline Pixel *generate_image(v2s size, f32 coverage, f32 noise, u32 seed) {
+    u32 state = seed ? seed : 1;
+    auto random = [&] {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    };
+    auto random_unit = [&] { return (random() >> 8) * (1.f / (1 << 24)); };
+
+    s32 const cell = 32;
+    v2s grid_size = size / cell + 2;
+    auto grid = current_allocator.allocate<f32>(grid_size.x*grid_size.y);
+    auto field = current_allocator.allocate<f32>((umm)size.x*size.y);
+    defer {
+        current_allocator.free(grid);
+        current_allocator.free(field);
+    };
+    for (s32 i = 0; i < grid_size.x*grid_size.y; ++i)
+        grid[i] = random_unit();
+
+    s32 histogram[1024] = {};
+    for (s32 y = 0; y < size.y; ++y) {
+        for (s32 x = 0; x < size.x; ++x) {
+            s32 gx = x / cell;
+            s32 gy = y / cell;
+            f32 tx = (f32)(x % cell) / cell;
+            f32 ty = (f32)(y % cell) / cell;
+            f32 top    = lerp(grid[gy*grid_size.x + gx],     grid[gy*grid_size.x + gx + 1],     tx);
+            f32 bottom = lerp(grid[(gy+1)*grid_size.x + gx], grid[(gy+1)*grid_size.x + gx + 1], tx);
+            f32 value = lerp(top, bottom, ty);
+            field[y*size.x + x] = value;
+            histogram[clamp((s32)(value * 1024), 0, 1023)] += 1;
+        }
+    }
+
+    // Threshold at the `coverage` quantile of the field.
+    umm covered = (umm)(clamp(coverage, 0.f, 1.f) * size.x * size.y);
+    f32 threshold = 1;
+    umm below = 0;
+    for (s32 i = 0; i < 1024; ++i) {
+        if (below >= covered) {
+            threshold = i / 1024.f;
+            break;
+        }
+        below += histogram[i];
+    }
+    if (covered == 0)
+        threshold = -1;
+
+    auto pixels = current_allocator.allocate<Pixel>((umm)size.x*size.y);
+    for (s32 y = 0; y < size.y; ++y) {
+        for (s32 x = 0; x < size.x; ++x) {
+            auto add_noise = [&](f32 value) {
+                return (u8)clamp((s32)(value + (random_unit() * 2 - 1) * noise * 255), 0, 255);
+            };
+            pixels[y*size.x + x] = {
+                add_noise(255.f * x / size.x),
+                add_noise(255.f * y / size.y),
+                add_noise(field[y*size.x + x] * 255),
+                (u8)(field[y*size.x + x] < threshold ? 255 : 0),
+            };
+        }
+    }
+    return pixels;
+}
+
+struct BenchResult {
+    std::string name;
+    f64 milliseconds;
+    f64 megapixels_per_second;
+};
+
+// Reads "case" and "mpps" pairs from a file written by `save_results`.
+inline bool load_baseline(Span<utf8> path, std::vector<BenchResult> &results) {
+    auto buffer = read_entire_file(path);
+    if (!buffer.data)
+        return false;
+    defer { free(buffer); };
+
+    std::string text((char *)buffer.data, buffer.count);
+    for (umm cursor = 0; (cursor = text.find("\"case\"", cursor)) != std::string::npos;) {
+        auto name_begin = text.find('"', text.find(':', cursor)) + 1;
+        auto name_end = text.find('"', name_begin);
+        auto mpps = text.find("\"mpps\"", name_end);
+        if (name_end == std::string::npos || mpps == std::string::npos)
+            break;
+
+        results.push_back({
+            .name = text.substr(name_begin, name_end - name_begin),
+            .milliseconds = 0,
+            .megapixels_per_second = strtod(text.c_str() + text.find(':', mpps) + 1, 0),
+        });
+        cursor = mpps;
+    }
+    return true;
+}
+
+inline bool save_results(Span<utf8> path, v2s size, s32 thread_count, std::vector<BenchResult> &results) {
+    auto file = fopen(to_path(path).string().c_str(), "wb");
+    if (!file)
+        return false;
+
+    fprintf(file, "{\n  \"size\": [%d, %d],\n  \"threads\": %d,\n  \"results\": [\n", size.x, size.y, thread_count);
+    for (umm i = 0; i < results.size(); ++i) {
+        fprintf(file, "    {\"case\": \"%s\", \"ms\": %.3f, \"mpps\": %.3f}%s\n",
+            results[i].name.c_str(), results[i].milliseconds, results[i].megapixels_per_second, i + 1 == results.size() ? "" : ",");
+    }
+    fprintf(file, "  ]\n}\n");
+    return fclose(file) == 0;
+}
+
+s32 tl_main(Span<Span<utf8>> args) {
+    init_printer();
+
+    register_filters();
+
+    s32 thread_count = std::thread::hardware_concurrency();
+    SimdLevel simd_level = {SimdLevel::avx512};
+    v2s size = {1024, 1024};
+    f32 coverage = 0.3f;
+    f32 noise = 0.1f;
+    s32 repeat = 3;
+    f32 tolerance = 10;
+    Span<utf8> only = {};
+    Span<utf8> save_path = {};
+    Span<utf8> baseline_path = {};
+
+    for (umm i = 1; i < args.count; ++i) {
+        auto parse_value = [&](auto *result) {
+            auto name = args[i];
+            ++i;
+            if (i >= args.count) {
+                with(ConsoleColor::red, print("Error: "));
+                print("Expected a value after '{}', but got nothing\n", name);
+                return false;
+            }
+            return parse_option(name, args[i], result);
+        };
+
+        bool ok;
+        if      (args[i] == u8"--threads"s)   ok = parse_value(&thread_count);
+        else if (args[i] == u8"--simd"s)      ok = parse_value(&simd_level);
+        else if (args[i] == u8"--size"s)      ok = parse_value(&size);
+        else if (args[i] == u8"--coverage"s)  ok = parse_value(&coverage);
+        else if (args[i] == u8"--noise"s)     ok = parse_value(&noise);
+        else if (args[i] == u8"--repeat"s)    ok = parse_value(&repeat);
+        else if (args[i] == u8"--tolerance"s) ok = parse_value(&tolerance);
+        else if (args[i] == u8"--only"s)      ok = parse_value(&only);
+        else if (args[i] == u8"--save"s)      ok = parse_value(&save_path);
+        else if (args[i] == u8"--baseline"s)  ok = parse_value(&baseline_path);
+        else if (args[i] == u8"--tile"s)      ok = parse_value(&tile_size);
+        else {
+            print(R"(Usage: {} [<options>]
+Options
+  --threads <count>
+  --simd scalar|sse41|avx2|avx512
+  --size <width>x<height>   Synthetic image size, default 1024x1024
+  --coverage <0-1>          Fraction of opaque pixels, default 0.3
+  --noise <0-1>             Color noise amplitude, default 0.1
+  --repeat <count>          Timed runs per case, the fastest is reported, default 3
+  --only <filter>           Run cases of one filter
+  --save <json>             Save results
+  --baseline <json>         Compare with saved results
+  --tolerance <percent>     Slowdown reported as a regression, default 10
+  --tile <width>x<height>   Output tile of bilateral, <width>x1 with the full width scans rows
+)", args[0]);
+            return 1;
+        }
+        if (!ok)
+            return 1;
+    }
+
+    if (size.x <= 0 || size.y <= 0) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Image size must be positive\n");
+        return 1;
+    }
+    repeat = max(repeat, 1);
+
+    init_thread_pool(thread_pool, thread_count);
+    defer { free(thread_pool); };
+
+    init_kernels(simd_level);
+
+    std::vector<BenchResult> baseline;
+    if (baseline_path.count && !load_baseline(baseline_path, baseline)) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Failed to read '{}'\n", baseline_path);
+        return 4;
+    }
+
+    auto source_pixels = generate_image(size, coverage, noise, 1);
+    defer { current_allocator.free(source_pixels); };
+
+    print("{}x{}, coverage {}, noise {}, {} threads, simd {}\n", size.x, size.y, coverage, noise, thread_pool.thread_count, kernels.level);
+
+    struct Case {
+        Filter *filter;
+        char const *options;
+    };
+
+    List<Case> cases;
+    defer { free(cases); };
+    for (auto &filter : filters) {
+        if (only.count && filter.name != only)
+            continue;
+
+        bool listed = false;
+        for (auto &bench_case : bench_cases) {
+            if (filter.name == Span<utf8>{(utf8 *)bench_case.filter, strlen(bench_case.filter)}) {
+                cases.add({&filter, bench_case.options});
+                listed = true;
+            }
+        }
+        if (!listed)
+            cases.add({&filter, ""});
+    }
+
+    std::vector<BenchResult> results;
+
+    auto state = current_allocator.allocate<u8>(filter_state_size);
+    defer { current_allocator.free(state); };
+
+    FilterCache cache;
+    defer { free(cache); };
+
+    s32 regression_count = 0;
+
+    for (auto &bench_case : cases) {
+        auto filter = bench_case.filter;
+
+        std::string options_string = bench_case.options;
+        List<Span<utf8>> options;
+        defer { free(options); };
+        for (umm begin = 0; begin < options_string.size();) {
+            auto end = options_string.find(' ', begin);
+            if (end == std::string::npos)
+                end = options_string.size();
+            options.add({(utf8 *)options_string.data() + begin, end - begin});
+            begin = end + 1;
+        }
+
+        if (!filter->parse(options, state)) {
+            return 3;
+        }
+
+        auto destination_size = filter->get_destination_size(size, state);
+        auto destination_pixels = current_allocator.allocate<Pixel>((umm)destination_size.x*destination_size.y);
+        defer { current_allocator.free(destination_pixels); };
+
+        // One untimed run to warm caches and lazily built tables.
+        verbose = false;
+        filter->apply(source_pixels, size, destination_pixels, destination_size, cache, state);
+
+        f64 best_seconds = 1e30;
+        for (s32 i = 0; i < repeat; ++i) {
+            auto timer = create_precise_timer();
+            filter->apply(source_pixels, size, destination_pixels, destination_size, cache, state);
+            best_seconds = min(best_seconds, get_time(timer));
+        }
+        verbose = true;
+
+        BenchResult result = {
+            .name = std::string((char *)filter->name.data, filter->name.count) + (options_string.size() ? " " + options_string : ""),
+            .milliseconds = best_seconds * 1000,
+            .megapixels_per_second = (f64)size.x*size.y / best_seconds / 1e6,
+        };
+        results.push_back(result);
+
+        print("{}: {} ms, {} MP/s", Span<char>{result.name.data(), result.name.size()}, result.milliseconds, result.megapixels_per_second);
+
+        auto found = std::find_if(baseline.begin(), baseline.end(), [&](auto &entry) { return entry.name == result.name; });
+        if (found != baseline.end()) {
+            f64 change = (result.megapixels_per_second / found->megapixels_per_second - 1) * 100;
+            print(", baseline {} MP/s, ", found->megapixels_per_second);
+            if (change < -tolerance) {
+                with(ConsoleColor::red, print("{}%", change));
+                ++regression_count;
+            } else {
+                print("{}%", change);
+            }
+        }
+        print("\n");
+    }
+
+    if (save_path.count && !save_results(save_path, size, thread_pool.thread_count, results)) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Failed to write '{}'\n", save_path);
+        return 7;
+    }
+
+    if (regression_count) {
+        with(ConsoleColor::red, print("{} cases are more than {}% slower than the baseline\n", regression_count, tolerance));
+        return 9;
+    }
+
+    return 0;
+}
@@ -0,0 +1,4701 @@
+// Everything declared in filter.h. Compiled once per program, stb_image's implementation stays private to this file.
+
+#include "filter.h"
+
+#include <deque>
+#include <algorithm>
+#include <array>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#endif
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#define STB_IMAGE_STATIC
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+bool verbose = true;
+
+// Called by the first pool thread as it starts a row. Prints at most a few times per second, printing every row
+// used to cost measurable time on tall images and flooded logs.
+void report_progress(s32 row, s32 row_count) {
+    static PreciseTimer timer = create_precise_timer();
+    if (!verbose || get_time(timer) < 0.25)
+        return;
+    reset(timer);
+    print("Row {}/{}\r", row, row_count);
+}
+
+// Wall time of each phase of a run plus pixel counts, written by --stats. Phases may run on several threads at once
+// in batch mode, their times are summed over threads.
+enum class Phase {
+    read,
+    decode,
+    parse,
+    offset_table,
+    apply,
+    encode,
+    write,
+    count,
+};
+
+static char const *phase_names[] = {"read", "decode", "parse", "offset_table", "apply", "encode", "write"};
+
+struct Stats {
+    std::atomic<f64> seconds[(umm)Phase::count] = {};
+    std::atomic<u64> images = 0;
+    std::atomic<u64> input_pixels = 0;
+    std::atomic<u64> output_pixels = 0;
+    std::atomic<u64> cache_hits = 0;
+    std::atomic<u64> cache_misses = 0;
+};
+
+static Stats stats;
+
+void add_time(Phase phase, PreciseTimer timer) {
+    stats.seconds[(umm)phase] += get_time(timer);
+}
+
+void count_image(v2s input_size, v2s output_size) {
+    stats.images += 1;
+    stats.input_pixels += (u64)input_size.x*input_size.y;
+    stats.output_pixels += (u64)output_size.x*output_size.y;
+}
+
+ThreadPool thread_pool;
+thread_local bool inside_parallel_for = false;
+
+bool next_index(ThreadPool &pool, s32 thread_index, s32 *index) {
+    auto &own = pool.ranges[thread_index];
+    {
+        std::lock_guard lock(own.mutex);
+        if (own.begin < own.end) {
+            *index = own.begin++;
+            return true;
+        }
+    }
+
+    for (s32 i = 1; i < pool.thread_count; ++i) {
+        auto &victim = pool.ranges[(thread_index + i) % pool.thread_count];
+
+        s32 begin, end;
+        {
+            std::lock_guard lock(victim.mutex);
+            if (victim.begin >= victim.end)
+                continue;
+            begin = victim.begin + (victim.end - victim.begin) / 2;
+            end = victim.end;
+            victim.end = begin;
+        }
+
+        std::lock_guard lock(own.mutex);
+        own.begin = begin + 1;
+        own.end = end;
+        *index = begin;
+        return true;
+    }
+    return false;
+}
+
+void run_job(ThreadPool &pool, s32 thread_index) {
+    inside_parallel_for = true;
+    s32 index;
+    while (next_index(pool, thread_index, &index)) {
+        pool.job(pool.job_fn, index, thread_index);
+    }
+    inside_parallel_for = false;
+}
+
+void init_thread_pool(ThreadPool &pool, s32 thread_count) {
+    pool.thread_count = max(thread_count, 1);
+    pool.ranges = new ThreadPool::Range[pool.thread_count];
+
+    auto allocator = current_allocator;
+    for (s32 thread_index = 1; thread_index < pool.thread_count; ++thread_index) {
+        pool.workers.emplace_back([&pool, thread_index, allocator] {
+            current_allocator = allocator;
+
+            u64 seen_generation = 0;
+            while (true) {
+                {
+                    std::unique_lock lock(pool.mutex);
+                    pool.job_started.wait(lock, [&] { return pool.stopping || pool.job_generation != seen_generation; });
+                    if (pool.stopping)
+                        return;
+                    seen_generation = pool.job_generation;
+                }
+
+                run_job(pool, thread_index);
+
+                std::lock_guard lock(pool.mutex);
+                if (--pool.busy_worker_count == 0)
+                    pool.job_finished.notify_one();
+            }
+        });
+    }
+}
+
+void free(ThreadPool &pool) {
+    {
+        std::lock_guard lock(pool.mutex);
+        pool.stopping = true;
+    }
+    pool.job_started.notify_all();
+    for (auto &worker : pool.workers)
+        worker.join();
+    pool.workers.clear();
+    delete[] pool.ranges;
+    pool.ranges = 0;
+    pool.thread_count = 1;
+    pool.stopping = false;
+}
+
+// Metrics for `find_nearest_seeds`, see Meijster et al. "A General Algorithm for Computing Distance Transforms in Linear Time".
+// `f` is the distance from `x` to a column `i` whose nearest seed is `g` pixels away vertically.
+// `sep` is the first `x` at which column `u` becomes closer than column `i` (i < u).
+struct EuclideanMetric {
+    static s64 f(s64 x, s64 i, s64 g) { return (x-i)*(x-i) + g*g; }
+    static s64 sep(s64 i, s64 u, s64 gi, s64 gu) {
+        s64 n = u*u - i*i + gu*gu - gi*gi;
+        s64 d = 2*(u - i);
+        return n >= 0 ? n / d : -((-n + d - 1) / d);
+    }
+};
+struct ManhattanMetric {
+    static constexpr s64 never = (s64)1 << 40;
+    static s64 f(s64 x, s64 i, s64 g) { return absolute(x-i) + g; }
+    static s64 sep(s64 i, s64 u, s64 gi, s64 gu) {
+        if (gu >= gi + u - i) return +never;
+        if (gi >  gu + u - i) return -never;
+        return (gu - gi + u + i) / 2;
+    }
+};
+struct ChebyshevMetric {
+    static s64 f(s64 x, s64 i, s64 g) { return max(absolute(x-i), g); }
+    static s64 sep(s64 i, s64 u, s64 gi, s64 gu) {
+        if (gi <= gu) return max(i + gu, (i + u) / 2);
+        else          return min(u - gi, (i + u) / 2);
+    }
+};
+
+// Finds the closest seed for every pixel in O(width*height), regardless of distance.
+// First pass finds the closest seed in each column, second pass merges columns in each row
+// using the lower envelope of per-column distance functions.
+// Calls `on_nearest(x, y, seed_x, seed_y)` for every pixel that has a seed somewhere in the image.
+template <class Metric, class IsSeed, class OnNearest>
+void find_nearest_seeds(v2s size, IsSeed &&is_seed, OnNearest &&on_nearest) {
+    s32 const infinity = size.x + size.y;
+
+    auto column_distances = current_allocator.allocate<s32>(size.x*size.y);
+    auto column_seeds     = current_allocator.allocate<s32>(size.x*size.y);
+    defer {
+        current_allocator.free(column_distances);
+        current_allocator.free(column_seeds);
+    };
+
+    parallel_for(size.x, [&](s32 x, s32) {
+        s32 seed = -infinity;
+        for (s32 y = 0; y < size.y; ++y) {
+            if (is_seed(x, y))
+                seed = y;
+            column_distances[y*size.x + x] = seed == -infinity ? infinity : y - seed;
+            column_seeds[y*size.x + x] = seed;
+        }
+        seed = -infinity;
+        for (s32 y = size.y - 1; y >= 0; --y) {
+            if (is_seed(x, y))
+                seed = y;
+            if (seed != -infinity && seed - y < column_distances[y*size.x + x]) {
+                column_distances[y*size.x + x] = seed - y;
+                column_seeds[y*size.x + x] = seed;
+            }
+        }
+    });
+
+    auto all_envelope_columns = current_allocator.allocate<s32>(size.x*thread_pool.thread_count);
+    auto all_envelope_starts  = current_allocator.allocate<s64>(size.x*thread_pool.thread_count);
+    defer {
+        current_allocator.free(all_envelope_columns);
+        current_allocator.free(all_envelope_starts);
+    };
+
+    parallel_for(size.y, [&](s32 y, s32 thread_index) {
+        if (thread_index == 0)
+            report_progress(y, size.y);
+
+        auto envelope_columns = all_envelope_columns + size.x*thread_index;
+        auto envelope_starts  = all_envelope_starts  + size.x*thread_index;
+
+        auto g = column_distances + y*size.x;
+
+        s32 q = 0;
+        envelope_columns[0] = 0;
+        envelope_starts[0] = 0;
+        for (s32 u = 1; u < size.x; ++u) {
+            while (q >= 0 && Metric::f(envelope_starts[q], envelope_columns[q], g[envelope_columns[q]]) > Metric::f(envelope_starts[q], u, g[u]))
+                --q;
+
+            if (q < 0) {
+                q = 0;
+                envelope_columns[0] = u;
+            } else {
+                s64 start = 1 + Metric::sep(envelope_columns[q], u, g[envelope_columns[q]], g[u]);
+                if (start < size.x) {
+                    ++q;
+                    envelope_columns[q] = u;
+                    envelope_starts[q] = start;
+                }
+            }
+        }
+
+        for (s32 u = size.x - 1; u >= 0; --u) {
+            auto column = envelope_columns[q];
+            if (g[column] < infinity)
+                on_nearest(u, y, column, column_seeds[y*size.x + column]);
+            if (u == envelope_starts[q])
+                --q;
+        }
+    });
+}
+
+void free(FilterCache &cache) {
+    free(cache.dilate_offsets);
+    cache = {};
+}
+
+template <class Metric, class A, class B>
+void dilate(Pixel *source_pixels, Pixel *destination_pixels, v2s size, s32 radius, bool smooth, FilterCache &cache, A &&should_be_dilated, B &&get_length)
+    requires requires { {should_be_dilated(Pixel{}) } -> std::same_as<bool>; }
+{
+    if (smooth) {
+        auto &offsets = cache.dilate_offsets;
+        v2s extent = {min(radius, size.x - 1), min(radius, size.y - 1)};
+
+        if (cache.dilate_radius != radius || cache.dilate_extent.x != extent.x || cache.dilate_extent.y != extent.y ||
+            !cache.dilate_metric || *cache.dilate_metric != typeid(Metric)) {
+            verbose_print("Building offset table...\n");
+
+            auto timer = create_precise_timer();
+            defer { add_time(Phase::offset_table, timer); };
+
+            offsets.clear();
+            offsets.reserve((extent.x*2 + 1)*(extent.y*2 + 1));
+
+            for (s32 iy = -extent.y; iy <= extent.y; ++iy) {
+            for (s32 ix = -extent.x; ix <= extent.x; ++ix) {
+                auto offset = v2s16{(s16)ix,(s16)iy};
+                if (get_length(offset) <= radius)
+                    offsets.add(offset);
+            }
+            }
+
+            quick_sort(offsets, get_length);
+
+            cache.dilate_extent = extent;
+            cache.dilate_radius = radius;
+            cache.dilate_metric = &typeid(Metric);
+        }
+
+        struct FactoredPixel {
+            Pixel pixel;
+            f32 factor;
+        };
+
+        auto all_closest_pixels = new List<FactoredPixel>[thread_pool.thread_count];
+        defer {
+            for (s32 i = 0; i < thread_pool.thread_count; ++i)
+                free(all_closest_pixels[i]);
+            delete[] all_closest_pixels;
+        };
+
+        // Pixels without a kept pixel within `radius` turn opaque black.
+        auto dilate_pixel = [&](s32 ix, s32 iy, s32 thread_index) {
+            Pixel p = source_pixels[iy*size.x + ix];
+
+            if (should_be_dilated(p)) {
+                auto &closest_pixels = all_closest_pixels[thread_index];
+                closest_pixels.count = 0;
+                f32 closest_pixel_distance = 0;
+                for (auto offset : offsets/*.skip(next_time_starting_from)*/) {
+                    smm jx = ix + offset.x;
+                    smm jy = iy + offset.y;
+
+                    if ((umm)jx >= size.x) continue;
+                    if ((umm)jy >= size.y) continue;
+
+                    auto t = source_pixels[jy*size.x + jx];
+                    if (!should_be_dilated(t)) {
+                        f32 distance = length(offset);
+
+                        //f32 const max_distance = sqrt2 - 1;
+                        f32 const max_distance = 1;
+
+                        if (closest_pixels.count == 0) {
+                            closest_pixel_distance = distance;
+                            closest_pixels.add({t, 1});
+                        } else {
+                            if (distance >= closest_pixel_distance + max_distance) {
+                                //update_starting_index(index_of(offsets, &offset), 2);
+                                break;
+                            }
+                            //closest_pixels.add({t, (distance - closest_pixel_distance) / max_distance});
+                            closest_pixels.add({t, 1});
+                        }
+                    }
+                }
+
+                v3f color_sum = {};
+                f32 factor_sum = {};
+                for (auto t : closest_pixels) {
+                    color_sum += (v3f)t.pixel.xyz * t.factor;
+                    factor_sum += t.factor;
+                }
+
+                if (closest_pixels.count)
+                    p.xyz = autocast (color_sum / factor_sum);
+                else
+                    p.xyz = {};
+                p.w = 255;
+            } else {
+                p.w = 255;
+            }
+
+            destination_pixels[iy*size.x + ix] = p;
+        };
+
+        // Occupancy of the mask per tile, from one pass over the image. Tiles with only kept pixels, and tiles
+        // with only pixels to dilate and no kept pixel within `radius`, give the same result for every pixel.
+        // Only tiles on the boundary search offsets, so time grows with the boundary rather than the area.
+        s32 const tile = 32;
+        u8 const has_dilated = 1;
+        u8 const has_kept = 2;
+
+        v2s tile_count = (size + tile - 1) / tile;
+        s32 total_tile_count = tile_count.x*tile_count.y;
+
+        auto occupancy = current_allocator.allocate<u8>(total_tile_count);
+        auto near_kept = current_allocator.allocate<u8>(total_tile_count);
+        auto row_kept  = current_allocator.allocate<u8>(total_tile_count);
+        defer {
+            current_allocator.free(occupancy);
+            current_allocator.free(near_kept);
+            current_allocator.free(row_kept);
+        };
+
+        parallel_for(tile_count.y, [&](s32 ty, s32) {
+            auto flags = occupancy + ty*tile_count.x;
+            memset(flags, 0, tile_count.x);
+            for (s32 iy = ty*tile; iy < min((ty + 1)*tile, size.y); ++iy) {
+                for (s32 tx = 0; tx < tile_count.x; ++tx) {
+                    u8 tile_flags = 0;
+                    for (s32 ix = tx*tile; ix < min((tx + 1)*tile, size.x); ++ix)
+                        tile_flags |= should_be_dilated(source_pixels[iy*size.x + ix]) ? has_dilated : has_kept;
+                    flags[tx] |= tile_flags;
+                }
+            }
+        });
+
+        // Tiles within `reach` tiles in both directions cover every offset within `radius`.
+        s32 reach = min((radius + tile - 1) / tile, max(tile_count.x, tile_count.y));
+        parallel_for(tile_count.y, [&](s32 ty, s32) {
+            for (s32 tx = 0; tx < tile_count.x; ++tx) {
+                u8 kept = 0;
+                for (s32 x = max(tx - reach, 0); x <= min(tx + reach, tile_count.x - 1); ++x)
+                    kept |= occupancy[ty*tile_count.x + x] & has_kept;
+                row_kept[ty*tile_count.x + tx] = kept;
+            }
+        });
+        parallel_for(tile_count.y, [&](s32 ty, s32) {
+            for (s32 tx = 0; tx < tile_count.x; ++tx) {
+                u8 kept = 0;
+                for (s32 y = max(ty - reach, 0); y <= min(ty + reach, tile_count.y - 1); ++y)
+                    kept |= row_kept[y*tile_count.x + tx];
+                near_kept[ty*tile_count.x + tx] = kept;
+            }
+        });
+
+        parallel_for(total_tile_count, [&](s32 tile_index, s32 thread_index) {
+            v2s tile_min = v2s{tile_index % tile_count.x, tile_index / tile_count.x} * tile;
+            v2s tile_max = {min(tile_min.x + tile, size.x), min(tile_min.y + tile, size.y)};
+            if (thread_index == 0)
+                report_progress(tile_min.y, size.y);
+
+            auto flags = occupancy[tile_index];
+            for (s32 iy = tile_min.y; iy < tile_max.y; ++iy) {
+                if (!(flags & has_dilated)) {
+                    for (s32 ix = tile_min.x; ix < tile_max.x; ++ix) {
+                        auto p = source_pixels[iy*size.x + ix];
+                        p.w = 255;
+                        destination_pixels[iy*size.x + ix] = p;
+                    }
+                } else if (!near_kept[tile_index]) {
+                    for (s32 ix = tile_min.x; ix < tile_max.x; ++ix)
+                        destination_pixels[iy*size.x + ix] = {0, 0, 0, 255};
+                } else {
+                    for (s32 ix = tile_min.x; ix < tile_max.x; ++ix)
+                        dilate_pixel(ix, iy, thread_index);
+                }
+            }
+        });
+    } else {
+        // Pixels without a seed within `radius` stay as they are.
+        for (s32 i = 0; i < size.x*size.y; ++i) {
+            destination_pixels[i] = source_pixels[i];
+        }
+
+        find_nearest_seeds<Metric>(size,
+            [&](s32 x, s32 y) { return !should_be_dilated(source_pixels[y*size.x + x]); },
+            [&](s32 x, s32 y, s32 seed_x, s32 seed_y) {
+                auto &p = destination_pixels[y*size.x + x];
+                if (seed_x == x && seed_y == y) {
+                    p.w = 255;
+                } else if (get_length(v2s16{(s16)(seed_x - x), (s16)(seed_y - y)}) <= radius) {
+                    p.xyz = source_pixels[seed_y*size.x + seed_x].xyz;
+                    p.w = 255;
+                }
+            }
+        );
+    }
+}
+
+// Fills pixels that should be dilated from an alpha-weighted mip pyramid. Each level is a 2x2 box
+// reduction of the previous one with colors premultiplied by coverage (push), then holes are filled
+// coarse-to-fine from the bilinearly upsampled parent level (pull). Colors are blended from nearby
+// opaque pixels instead of copying the exact nearest one. Reach is limited to roughly `radius`.
+template <class A>
+void dilate_push_pull(Pixel *source_pixels, Pixel *destination_pixels, v2s size, s32 radius, A &&should_be_dilated)
+    requires requires { {should_be_dilated(Pixel{}) } -> std::same_as<bool>; }
+{
+    struct Level {
+        v4f *pixels;
+        v2s size;
+    };
+
+    List<Level> levels;
+    defer { free(levels); };
+
+    umm total_pixel_count = 0;
+    for (v2s level_size = size; ; level_size = (level_size + 1) / 2) {
+        levels.add({.pixels = 0, .size = level_size});
+        total_pixel_count += level_size.x*level_size.y;
+        if (level_size.x == 1 && level_size.y == 1)
+            break;
+        if ((1 << (levels.count - 1)) >= radius)
+            break;
+    }
+
+    auto pyramid = current_allocator.allocate<v4f>(total_pixel_count);
+    defer { current_allocator.free(pyramid); };
+
+    levels[0].pixels = pyramid;
+    for (umm i = 1; i < levels.count; ++i) {
+        levels[i].pixels = levels[i - 1].pixels + levels[i - 1].size.x*levels[i - 1].size.y;
+    }
+
+    verbose_print("Push...\n");
+
+    parallel_for(size.y, [&](s32 y, s32) {
+        for (s32 i = y*size.x; i < (y + 1)*size.x; ++i) {
+            auto p = source_pixels[i];
+            if (should_be_dilated(p)) {
+                pyramid[i] = {};
+            } else {
+                pyramid[i] = (v4f)p;
+                pyramid[i].w = 1;
+            }
+        }
+    });
+
+    for (umm l = 1; l < levels.count; ++l) {
+        auto &fine = levels[l - 1];
+        auto &coarse = levels[l];
+        parallel_for(coarse.size.y, [&](s32 y, s32) {
+        for (s32 x = 0; x < coarse.size.x; ++x) {
+            v4f sum = {};
+            s32 count = 0;
+            for (s32 oy = 0; oy < 2; ++oy) {
+            for (s32 ox = 0; ox < 2; ++ox) {
+                s32 fx = x*2 + ox;
+                s32 fy = y*2 + oy;
+                if (fx < fine.size.x && fy < fine.size.y) {
+                    sum += fine.pixels[fy*fine.size.x + fx];
+                    count += 1;
+                }
+            }
+            }
+            coarse.pixels[y*coarse.size.x + x] = sum / (f32)count;
+        }
+        });
+    }
+
+    verbose_print("Pull...\n");
+
+    for (umm l = levels.count - 1; l > 0; --l) {
+        auto &coarse = levels[l];
+        auto &fine = levels[l - 1];
+        parallel_for(fine.size.y, [&](s32 y, s32) {
+        for (s32 x = 0; x < fine.size.x; ++x) {
+            auto &p = fine.pixels[y*fine.size.x + x];
+            if (p.w >= 1)
+                continue;
+
+            v2f c = {x * 0.5f - 0.25f, y * 0.5f - 0.25f};
+            v2s c0 = floor_to_int(c);
+            v2f t = c - (v2f)c0;
+            v2s c1 = min(c0 + 1, coarse.size - 1);
+            c0 = max(c0, V2s(0));
+
+            auto sample = [&](s32 sx, s32 sy) { return coarse.pixels[sy*coarse.size.x + sx]; };
+            v4f parent = lerp(lerp(sample(c0.x, c0.y), sample(c1.x, c0.y), t.x),
+                              lerp(sample(c0.x, c1.y), sample(c1.x, c1.y), t.x), t.y);
+
+            p += parent * (1 - p.w);
+        }
+        });
+    }
+
+    parallel_for(size.y, [&](s32 y, s32) {
+        for (s32 i = y*size.x; i < (y + 1)*size.x; ++i) {
+            auto p = source_pixels[i];
+            if (should_be_dilated(p)) {
+                auto filled = pyramid[i];
+                if (filled.w > 0) {
+                    p.xyz = autocast (filled.xyz / filled.w);
+                    p.w = 255;
+                }
+            } else {
+                p.w = 255;
+            }
+            destination_pixels[i] = p;
+        }
+    });
+}
+
+// Approximate bilateral filter (Paris and Durand, "A Fast Approximation of the Bilateral Filter").
+// Source is splatted into a coarse (x, y, luma) grid of color and weight sums, the grid is blurred with
+// a [1 2 1] kernel along each axis and then sampled back trilinearly at each pixel's position and luma.
+// `spatial_cell` and `range_cell` are grid cell sizes in pixels and luma units.
+void bilateral_grid(Pixel *source_pixels, Pixel *destination_pixels, v2s size, f32 spatial_cell, f32 range_cell) {
+    struct Cell {
+        v4f color;
+        f32 weight;
+    };
+
+    // Empty cells on each side, so blur and trilinear sampling don't need bounds checks
+    // and blurring along flattened rows never mixes in cells from the next row.
+    v3s grid_size = {
+        (s32)((size.x - 1) / spatial_cell) + 4,
+        (s32)((size.y - 1) / spatial_cell) + 4,
+        (s32)(255 / range_cell) + 4,
+    };
+    auto cell_count = grid_size.x*grid_size.y*grid_size.z;
+
+    auto grid    = current_allocator.allocate<Cell>(cell_count);
+    auto blurred = current_allocator.allocate<Cell>(cell_count);
+    defer {
+        current_allocator.free(grid);
+        current_allocator.free(blurred);
+    };
+
+    memset(grid, 0, sizeof(Cell)*cell_count);
+
+    auto cell_index = [&](s32 x, s32 y, s32 z) {
+        return (z*grid_size.y + y)*grid_size.x + x;
+    };
+    auto luma = [](Pixel p) {
+        return dot((v3f)p.xyz, v3f{0.299f, 0.587f, 0.114f});
+    };
+
+    verbose_print("Splat...\n");
+
+    // Every task owns one row of the grid and splats all source rows that land in it.
+    parallel_for(grid_size.y, [&](s32 grid_y, s32) {
+        s32 first_y = max(floor_to_int((grid_y - 1.5f) * spatial_cell), 0);
+        s32 last_y = min(ceil_to_int((grid_y - 0.5f) * spatial_cell), size.y - 1);
+        for (s32 y = first_y; y <= last_y; ++y) {
+            if (round_to_int(y / spatial_cell) + 1 != grid_y)
+                continue;
+            for (s32 x = 0; x < size.x; ++x) {
+                auto p = source_pixels[y*size.x + x];
+                auto &cell = grid[cell_index(
+                    round_to_int(x / spatial_cell) + 1,
+                    grid_y,
+                    round_to_int(luma(p) / range_cell) + 1
+                )];
+                cell.color += (v4f)p;
+                cell.weight += 1;
+            }
+        }
+    });
+
+    verbose_print("Blur...\n");
+
+    s32 strides[] = {1, grid_size.x, grid_size.x*grid_size.y};
+    for (auto stride : strides) {
+        parallel_for(grid_size.y*grid_size.z, [&](s32 row, s32) {
+            for (s32 i = row*grid_size.x; i < (row + 1)*grid_size.x; ++i) {
+                if (i - stride < 0 || i + stride >= cell_count) {
+                    blurred[i] = grid[i];
+                    continue;
+                }
+                auto &a = grid[i - stride];
+                auto &b = grid[i];
+                auto &c = grid[i + stride];
+                blurred[i].color  = (a.color  + b.color *2 + c.color ) * 0.25f;
+                blurred[i].weight = (a.weight + b.weight*2 + c.weight) * 0.25f;
+            }
+        });
+        swap(grid, blurred);
+    }
+
+    verbose_print("Slice...\n");
+
+    parallel_for(size.y, [&](s32 y, s32) {
+    for (s32 x = 0; x < size.x; ++x) {
+        auto p = source_pixels[y*size.x + x];
+
+        v3f position = {x / spatial_cell + 1, y / spatial_cell + 1, luma(p) / range_cell + 1};
+        v3s p0 = floor_to_int(position);
+        v3f t = position - (v3f)p0;
+
+        Cell result = {};
+        for (s32 corner = 0; corner < 8; ++corner) {
+            s32 dx = corner & 1;
+            s32 dy = (corner >> 1) & 1;
+            s32 dz = (corner >> 2) & 1;
+            f32 w = (dx ? t.x : 1 - t.x) * (dy ? t.y : 1 - t.y) * (dz ? t.z : 1 - t.z);
+            auto &cell = grid[cell_index(p0.x + dx, p0.y + dy, p0.z + dz)];
+            result.color  += cell.color  * w;
+            result.weight += cell.weight * w;
+        }
+
+        destination_pixels[y*size.x + x] = result.weight > 0 ? (Pixel)(result.color / result.weight) : p;
+    }
+    });
+}
+
+// Radon-style projection used by `skidmark`. For every slice the source is rotated around its center and
+// summed along columns inside the inscribed circle. Rotated columns are walked incrementally with a constant
+// step, circle extents of every column are computed once, and slices are processed in parallel.
+void project_slices(Pixel *source_pixels, v2s source_size, Pixel *destination_pixels, s32 slices, bool average, bool bilinear) {
+    v2f half_size = (v2f)source_size * 0.5f;
+
+    auto column_starts = current_allocator.allocate<s32>(source_size.x);
+    auto column_ends   = current_allocator.allocate<s32>(source_size.x);
+    defer {
+        current_allocator.free(column_starts);
+        current_allocator.free(column_ends);
+    };
+
+    for (s32 x = 0; x < source_size.x; ++x) {
+        auto inside = [&](s32 y) { return length((v2f)v2s{x, y} - half_size) <= source_size.x * 0.5f; };
+        s32 start = 0;
+        while (start < source_size.y && !inside(start))
+            ++start;
+        s32 end = start;
+        while (end < source_size.y && inside(end))
+            ++end;
+        column_starts[x] = start;
+        column_ends[x] = end;
+    }
+
+    auto sample_bilinear = [&](v2f p) -> v4f {
+        v2f p0f = {floorf(p.x), floorf(p.y)};
+        v2s p0 = (v2s)p0f;
+        v2f t = p - p0f;
+        v4f result = {};
+        for (s32 corner = 0; corner < 4; ++corner) {
+            s32 dx = corner & 1;
+            s32 dy = corner >> 1;
+            s32 sx = p0.x + dx;
+            s32 sy = p0.y + dy;
+            if ((u32)sx < (u32)source_size.x && (u32)sy < (u32)source_size.y) {
+                result += (v4f)source_pixels[sy*source_size.x + sx] * ((dx ? t.x : 1 - t.x) * (dy ? t.y : 1 - t.y));
+            }
+        }
+        return result;
+    };
+
+    verbose_print("Projecting {} slices...\n", slices);
+
+    parallel_for(slices, [&](s32 slice, s32) {
+        // NOTE: do only 180 degrees, because two halfs are identical
+        f32 angle = (f32)slice / slices * pi;
+        auto rotation = m2::rotation(angle);
+        v2f x_step = rotation * v2f{1, 0};
+        v2f y_step = rotation * v2f{0, 1};
+        v2f origin = rotation * -half_size + half_size;
+
+        for (s32 x = 0; x < source_size.x; ++x) {
+            v2f pf = origin + x_step * (f32)x + y_step * (f32)column_starts[x];
+
+            v4u32 column_sum = {};
+            if (bilinear) {
+                v4f column_sumf = {};
+                for (s32 y = column_starts[x]; y < column_ends[x]; ++y) {
+                    column_sumf += sample_bilinear(pf);
+                    pf += y_step;
+                }
+                column_sum = (v4u32)round_to_int(column_sumf);
+            } else {
+                for (s32 y = column_starts[x]; y < column_ends[x]; ++y) {
+                    v2s p = round_to_int(pf);
+                    if ((u32)p.x < (u32)source_size.x && (u32)p.y < (u32)source_size.y) {
+                        column_sum += (v4u32)source_pixels[p.y*source_size.x + p.x];
+                    }
+                    pf += y_step;
+                }
+            }
+
+            if (average)
+                column_sum /= source_size.y;
+            column_sum = clamp(column_sum, (v4u32)V4s(0), (v4u32)V4s(255));
+            destination_pixels[slice*source_size.x + x] = (Pixel)column_sum;
+        }
+    });
+}
+
+bool parse_option(Span<utf8> name, Span<utf8> value, bool *result) {
+    auto is_true = [](Span<utf8> value) {
+        if (equals_case_insensitive(value, u8"true"s)) return true;
+        if (value == u8"1"s) return true;
+        if (value == u8"yes"s) return true;
+        return false;
+    };
+
+    auto is_false = [](Span<utf8> value) {
+        if (equals_case_insensitive(value, u8"false"s)) return true;
+        if (value == u8"0"s) return true;
+        if (value == u8"no"s) return true;
+        return false;
+    };
+
+    if (is_true (value)) { *result = true; return true; }
+    if (is_false(value)) { *result = false; return true; }
+   
+    with(ConsoleColor::red, print("Error: "));
+    print("Expected a boolean after '{}', but got '{}'n", name, value);
+    return false;
+}
+
+bool parse_option(Span<utf8> name, Span<utf8> value, s32 *result) {
+    auto parsed = parse_u64(value);
+    if (!parsed) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Expected an integer after '{}', but got '{}'n", name, value);
+        return false;
+    }
+
+    *result = parsed.value_unchecked();
+    return true;
+}
+
+#include <string>
+#include <stdexcept>
+
+bool parse_option(Span<utf8> name, Span<utf8> value, f32 *result) {
+    try {
+        *result = std::stof(std::string{(char *)value.begin(), (char *)value.end()});
+        return true;
+    } catch(std::invalid_argument&) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Expected a float after '{}', but got '{}'n", name, value);
+        return false;
+    }
+}
+
+// Parses "<width>x<height>".
+bool parse_option(Span<utf8> name, Span<utf8> value, v2s *result) {
+    umm separator = 0;
+    while (separator < value.count && value.data[separator] != 'x')
+        ++separator;
+
+    auto width = parse_u64(Span<utf8>{value.data, separator});
+    auto height = separator < value.count ? parse_u64(Span<utf8>{value.data + separator + 1, value.count - separator - 1}) : decltype(width){};
+    if (!width || !height) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Expected <width>x<height> after '{}', but got '{}'\n", name, value);
+        return false;
+    }
+
+    *result = {(s32)width.value_unchecked(), (s32)height.value_unchecked()};
+    return true;
+}
+
+bool parse_option(Span<utf8>, Span<utf8> value, Span<utf8> *result) {
+    *result = value;
+    return true;
+}
+
+#define _DEFINE_MEMBER(type, name, default) type name = default;
+#define _PARSE_OPTION(type, name, default) \
+    else if (selected_options[i] == u8###name##s) { \
+        ++i; \
+        if (i >= selected_options.count) { \
+            with(ConsoleColor::red, print("Error: ")); \
+            print("Expected an integer after '{}', but got nothing\n", u8###name##s); \
+            return false; \
+        } \
+        auto parsed = parse_u64(selected_options[i]); \
+        if (!parse_option(u8###name##s, selected_options[i], &state.name)) { \
+            return false; \
+        } \
+    }
+#define _HASH_OPTION(type, name, default) add_value(hasher, state.name);
+#define DEFINE_OPTIONS \
+    struct Options { \
+        ENUMERATE_OPTIONS(_DEFINE_MEMBER) \
+        static void hash(Hasher &hasher, void *_state) { \
+            auto &state = *(Options *)_state; \
+            ENUMERATE_OPTIONS(_HASH_OPTION) \
+        } \
+    };
+
+#define DEFINE_STATE \
+    auto &state = *(Options *)_state; \
+
+#define PARSE_OPTIONS \
+    for (umm i = 0; i < selected_options.count; ++i) { \
+        if (false) {} \
+        ENUMERATE_OPTIONS(_PARSE_OPTION) \
+        else { \
+            with(ConsoleColor::red, print("Warning: ")); \
+            print("Option '{}' not found, ignoring\n", selected_options[i]); \
+        } \
+    }
+
+#define ENUMERATE_ENUM(e) \
+    e(euclidean) \
+    e(manhattan) \
+    e(chebyshev) \
+
+DEFINE_ENUM(DistanceMethod);
+
+#undef ENUMERATE_ENUM
+
+#define ENUMERATE_ENUM(e) \
+    e(average) \
+    e(sum) \
+
+DEFINE_ENUM(Blend);
+
+#undef ENUMERATE_ENUM
+
+#define ENUMERATE_ENUM(e) \
+    e(nearest) \
+    e(pushpull) \
+
+DEFINE_ENUM(DilateMethod);
+
+#undef ENUMERATE_ENUM
+
+#define ENUMERATE_ENUM(e) \
+    e(exact) \
+    e(grid) \
+    e(gaussian) \
+
+DEFINE_ENUM(BilateralMode);
+
+#undef ENUMERATE_ENUM
+
+#define ENUMERATE_ENUM(e) \
+    e(nearest) \
+    e(bilinear) \
+
+DEFINE_ENUM(Sampling);
+
+#undef ENUMERATE_ENUM
+
+// What windows see beyond the image edges. `wrap` tiles the image, `clamp` repeats edge pixels, `mirror`
+// reflects the image without repeating edge pixels and `transparent` reads zero.
+#define ENUMERATE_ENUM(e) \
+    e(wrap) \
+    e(clamp) \
+    e(mirror) \
+    e(transparent) \
+
+DEFINE_ENUM(Border);
+
+#undef ENUMERATE_ENUM
+
+#define ENUMERATE_ENUM(e) \
+    e(square) \
+    e(disk) \
+
+DEFINE_ENUM(WindowShape);
+
+#undef ENUMERATE_ENUM
+
+// What min and max filters compare. `alpha` changes only alpha, `luma` picks the whole pixel with the
+// lowest or highest luma, `rgba` works on every channel on its own.
+#define ENUMERATE_ENUM(e) \
+    e(alpha) \
+    e(luma) \
+    e(rgba) \
+
+DEFINE_ENUM(MorphologyChannel);
+
+#undef ENUMERATE_ENUM
+
+// SIMD kernels for the innermost accumulation loops, selected at runtime by `init_kernels`.
+// Scalar versions are the reference and are used on other architectures.
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define KERNELS_X64 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define KERNEL_TARGET(x)
+#else
+#include <cpuid.h>
+#define KERNEL_TARGET(x) __attribute__((target(x)))
+#endif
+#else
+#define KERNELS_X64 0
+#endif
+
+f32 get_bilateral_weight(v4f center, v4f p, f32 scale) {
+    return 1.f - clamp(manhattan(center, p)/(255*3) * scale, 0.f, 1.f);
+}
+
+void bilateral_kernel_scalar(Pixel const *pixels, s32 count, v4f center, f32 scale, v4f *sum, f32 *den) {
+    for (s32 i = 0; i < count; ++i) {
+        auto p = (v4f)pixels[i];
+        auto w = get_bilateral_weight(center, p, scale);
+        *sum += p * w;
+        *den += w;
+    }
+}
+
+void row_sums_kernel_scalar(Pixel const *pixels, s32 count, v4u32 *row_sum, v4u32 *row_square, v4u32 *sums, v4u32 *squares) {
+    for (s32 i = 0; i < count; ++i) {
+        auto p = (v4u32)pixels[i];
+        *row_sum += p;
+        *row_square += p*p;
+        sums[i] = *row_sum;
+        squares[i] = *row_square;
+    }
+}
+
+#if KERNELS_X64
+
+// Vector kernels load pixels as 32-bit lanes and split channels with shifts, so every lane is one pixel.
+
+KERNEL_TARGET("sse4.1")
+void bilateral_kernel_sse41(Pixel const *pixels, s32 count, v4f center, f32 scale, v4f *sum, f32 *den) {
+    __m128 cr = _mm_set1_ps(center.x), cg = _mm_set1_ps(center.y), cb = _mm_set1_ps(center.z), ca = _mm_set1_ps(center.w);
+    __m128 k = _mm_set1_ps(scale / (255*3));
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+    __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128i byte_mask = _mm_set1_epi32(0xff);
+    __m128 sr = zero, sg = zero, sb = zero, sa = zero, sw = zero;
+
+    s32 i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((__m128i const *)(pixels + i));
+        __m128 r = _mm_cvtepi32_ps(_mm_and_si128(v, byte_mask));
+        __m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 8), byte_mask));
+        __m128 b = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 16), byte_mask));
+        __m128 a = _mm_cvtepi32_ps(_mm_srli_epi32(v, 24));
+
+        __m128 d = _mm_add_ps(
+            _mm_add_ps(_mm_and_ps(_mm_sub_ps(r, cr), abs_mask), _mm_and_ps(_mm_sub_ps(g, cg), abs_mask)),
+            _mm_add_ps(_mm_and_ps(_mm_sub_ps(b, cb), abs_mask), _mm_and_ps(_mm_sub_ps(a, ca), abs_mask)));
+        __m128 w = _mm_sub_ps(one, _mm_min_ps(_mm_max_ps(_mm_mul_ps(d, k), zero), one));
+
+        sr = _mm_add_ps(sr, _mm_mul_ps(r, w));
+        sg = _mm_add_ps(sg, _mm_mul_ps(g, w));
+        sb = _mm_add_ps(sb, _mm_mul_ps(b, w));
+        sa = _mm_add_ps(sa, _mm_mul_ps(a, w));
+        sw = _mm_add_ps(sw, w);
+    }
+
+    // Transpose so that lane i holds the total of channel i.
+    _MM_TRANSPOSE4_PS(sr, sg, sb, sa);
+    __m128 totals = _mm_add_ps(_mm_add_ps(sr, sg), _mm_add_ps(sb, sa));
+    sw = _mm_add_ps(sw, _mm_movehl_ps(sw, sw));
+    sw = _mm_add_ss(sw, _mm_shuffle_ps(sw, sw, 1));
+
+    f32 t[4];
+    _mm_storeu_ps(t, totals);
+    *sum += v4f{t[0], t[1], t[2], t[3]};
+    *den += _mm_cvtss_f32(sw);
+
+    bilateral_kernel_scalar(pixels + i, count - i, center, scale, sum, den);
+}
+
+KERNEL_TARGET("avx2")
+f32 reduce_add_avx2(__m256 x) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+KERNEL_TARGET("avx2")
+void bilateral_kernel_avx2(Pixel const *pixels, s32 count, v4f center, f32 scale, v4f *sum, f32 *den) {
+    __m256 cr = _mm256_set1_ps(center.x), cg = _mm256_set1_ps(center.y), cb = _mm256_set1_ps(center.z), ca = _mm256_set1_ps(center.w);
+    __m256 k = _mm256_set1_ps(scale / (255*3));
+    __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1);
+    __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256i byte_mask = _mm256_set1_epi32(0xff);
+    __m256 sr = zero, sg = zero, sb = zero, sa = zero, sw = zero;
+
+    s32 i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256((__m256i const *)(pixels + i));
+        __m256 r = _mm256_cvtepi32_ps(_mm256_and_si256(v, byte_mask));
+        __m256 g = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(v, 8), byte_mask));
+        __m256 b = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(v, 16), byte_mask));
+        __m256 a = _mm256_cvtepi32_ps(_mm256_srli_epi32(v, 24));
+
+        __m256 d = _mm256_add_ps(
+            _mm256_add_ps(_mm256_and_ps(_mm256_sub_ps(r, cr), abs_mask), _mm256_and_ps(_mm256_sub_ps(g, cg), abs_mask)),
+            _mm256_add_ps(_mm256_and_ps(_mm256_sub_ps(b, cb), abs_mask), _mm256_and_ps(_mm256_sub_ps(a, ca), abs_mask)));
+        __m256 w = _mm256_sub_ps(one, _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(d, k), zero), one));
+
+        sr = _mm256_add_ps(sr, _mm256_mul_ps(r, w));
+        sg = _mm256_add_ps(sg, _mm256_mul_ps(g, w));
+        sb = _mm256_add_ps(sb, _mm256_mul_ps(b, w));
+        sa = _mm256_add_ps(sa, _mm256_mul_ps(a, w));
+        sw = _mm256_add_ps(sw, w);
+    }
+
+    *sum += v4f{reduce_add_avx2(sr), reduce_add_avx2(sg), reduce_add_avx2(sb), reduce_add_avx2(sa)};
+    *den += reduce_add_avx2(sw);
+
+    bilateral_kernel_sse41(pixels + i, count - i, center, scale, sum, den);
+}
+
+KERNEL_TARGET("avx512f")
+void bilateral_kernel_avx512(Pixel const *pixels, s32 count, v4f center, f32 scale, v4f *sum, f32 *den) {
+    __m512 cr = _mm512_set1_ps(center.x), cg = _mm512_set1_ps(center.y), cb = _mm512_set1_ps(center.z), ca = _mm512_set1_ps(center.w);
+    __m512 k = _mm512_set1_ps(scale / (255*3));
+    __m512 zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1);
+    __m512i byte_mask = _mm512_set1_epi32(0xff);
+    __m512 sr = zero, sg = zero, sb = zero, sa = zero, sw = zero;
+
+    s32 i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512i v = _mm512_loadu_si512((void const *)(pixels + i));
+        __m512 r = _mm512_cvtepi32_ps(_mm512_and_si512(v, byte_mask));
+        __m512 g = _mm512_cvtepi32_ps(_mm512_and_si512(_mm512_srli_epi32(v, 8), byte_mask));
+        __m512 b = _mm512_cvtepi32_ps(_mm512_and_si512(_mm512_srli_epi32(v, 16), byte_mask));
+        __m512 a = _mm512_cvtepi32_ps(_mm512_srli_epi32(v, 24));
+
+        __m512 d = _mm512_add_ps(
+            _mm512_add_ps(_mm512_abs_ps(_mm512_sub_ps(r, cr)), _mm512_abs_ps(_mm512_sub_ps(g, cg))),
+            _mm512_add_ps(_mm512_abs_ps(_mm512_sub_ps(b, cb)), _mm512_abs_ps(_mm512_sub_ps(a, ca))));
+        __m512 w = _mm512_sub_ps(one, _mm512_min_ps(_mm512_max_ps(_mm512_mul_ps(d, k), zero), one));
+
+        sr = _mm512_add_ps(sr, _mm512_mul_ps(r, w));
+        sg = _mm512_add_ps(sg, _mm512_mul_ps(g, w));
+        sb = _mm512_add_ps(sb, _mm512_mul_ps(b, w));
+        sa = _mm512_add_ps(sa, _mm512_mul_ps(a, w));
+        sw = _mm512_add_ps(sw, w);
+    }
+
+    *sum += v4f{_mm512_reduce_add_ps(sr), _mm512_reduce_add_ps(sg), _mm512_reduce_add_ps(sb), _mm512_reduce_add_ps(sa)};
+    *den += _mm512_reduce_add_ps(sw);
+
+    bilateral_kernel_avx2(pixels + i, count - i, center, scale, sum, den);
+}
+
+// Running sums are sequential, so wider vectors don't help here and all levels above scalar use this one.
+KERNEL_TARGET("sse4.1")
+void row_sums_kernel_sse41(Pixel const *pixels, s32 count, v4u32 *row_sum, v4u32 *row_square, v4u32 *sums, v4u32 *squares) {
+    __m128i s = _mm_loadu_si128((__m128i const *)row_sum);
+    __m128i q = _mm_loadu_si128((__m128i const *)row_square);
+    for (s32 i = 0; i < count; ++i) {
+        __m128i p = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(*(s32 const *)(pixels + i)));
+        s = _mm_add_epi32(s, p);
+        q = _mm_add_epi32(q, _mm_mullo_epi32(p, p));
+        _mm_storeu_si128((__m128i *)(sums + i), s);
+        _mm_storeu_si128((__m128i *)(squares + i), q);
+    }
+    _mm_storeu_si128((__m128i *)row_sum, s);
+    _mm_storeu_si128((__m128i *)row_square, q);
+}
+
+SimdLevel detect_simd_level() {
+    auto cpuid = [](s32 leaf, s32 subleaf, u32 *regs) {
+#if defined(_MSC_VER)
+        __cpuidex((int *)regs, leaf, subleaf);
+#else
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    };
+    auto xgetbv = []() -> u64 {
+#if defined(_MSC_VER)
+        return _xgetbv(0);
+#else
+        u32 eax, edx;
+        __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return ((u64)edx << 32) | eax;
+#endif
+    };
+
+    u32 regs[4];
+    cpuid(0, 0, regs);
+    u32 max_leaf = regs[0];
+
+    cpuid(1, 0, regs);
+    bool sse41 = regs[2] & (1 << 19);
+    bool osxsave = regs[2] & (1 << 27);
+    bool avx = regs[2] & (1 << 28);
+    if (!sse41)
+        return {SimdLevel::scalar};
+
+    if (!osxsave || !avx || max_leaf < 7)
+        return {SimdLevel::sse41};
+
+    u64 xcr0 = xgetbv();
+    if ((xcr0 & 0x6) != 0x6)
+        return {SimdLevel::sse41};
+
+    cpuid(7, 0, regs);
+    bool avx2 = regs[1] & (1 << 5);
+    bool avx512f = regs[1] & (1 << 16);
+    if (!avx2)
+        return {SimdLevel::sse41};
+    if (avx512f && (xcr0 & 0xe6) == 0xe6)
+        return {SimdLevel::avx512};
+    return {SimdLevel::avx2};
+}
+
+#else
+
+SimdLevel detect_simd_level() { return {SimdLevel::scalar}; }
+
+#endif
+
+Kernels kernels;
+
+// Selects the widest kernels supported by this CPU, but not wider than `max_level`.
+void init_kernels(SimdLevel max_level) {
+    SimdLevel level = {min(detect_simd_level().value, max_level.value)};
+
+    kernels.level = level;
+    kernels.bilateral = bilateral_kernel_scalar;
+    kernels.bilateral_short = bilateral_kernel_scalar;
+    kernels.row_sums = row_sums_kernel_scalar;
+
+#if KERNELS_X64
+    switch (level.value) {
+        case SimdLevel::scalar: break;
+        case SimdLevel::sse41:  kernels.bilateral = bilateral_kernel_sse41;  kernels.row_sums = row_sums_kernel_sse41; break;
+        case SimdLevel::avx2:   kernels.bilateral = bilateral_kernel_avx2;   kernels.row_sums = row_sums_kernel_sse41; break;
+        case SimdLevel::avx512: kernels.bilateral = bilateral_kernel_avx512; kernels.row_sums = row_sums_kernel_sse41; break;
+    }
+    if (level.value != SimdLevel::scalar)
+        kernels.bilateral_short = bilateral_kernel_sse41;
+#endif
+}
+
+// Maps coordinate `x` outside of [0, size) into it, -1 means transparent.
+s32 get_border_coordinate(s32 x, s32 size, Border border) {
+    if (x >= 0 && x < size)
+        return x;
+
+    switch (border.value) {
+        case Border::wrap:
+            return frac(x, size);
+        case Border::clamp:
+            return clamp(x, 0, size - 1);
+        case Border::mirror: {
+            if (size == 1)
+                return 0;
+            s32 period = (size - 1)*2;
+            x = frac(x, period);
+            return x < size ? x : period - x;
+        }
+        case Border::transparent:
+            return -1;
+    }
+    return -1;
+}
+
+// Copy of an image with `padding` pixels on every side, filled according to a border mode.
+// Windows up to `padding` pixels wide index it directly, without wrapping or bounds checks.
+struct PaddedImage {
+    Pixel *pixels = 0;
+    v2s size = {};
+    s32 padding = 0;
+};
+
+void free(PaddedImage &image) {
+    if (image.pixels)
+        current_allocator.free(image.pixels);
+    image = {};
+}
+
+PaddedImage pad_image(Pixel *source_pixels, v2s source_size, s32 padding, Border border) {
+    PaddedImage image = {
+        .size = source_size + padding*2,
+        .padding = padding,
+    };
+    image.pixels = current_allocator.allocate<Pixel>((umm)image.size.x*image.size.y, 64);
+
+    auto columns = current_allocator.allocate<s32>(padding*2);
+    defer { current_allocator.free(columns); };
+
+    for (s32 i = 0; i < padding; ++i) {
+        columns[i] = get_border_coordinate(i - padding, source_size.x, border);
+        columns[padding + i] = get_border_coordinate(source_size.x + i, source_size.x, border);
+    }
+
+    parallel_for(image.size.y, [&](s32 ty, s32) {
+        auto destination = image.pixels + (umm)ty*image.size.x;
+        s32 y = get_border_coordinate(ty - padding, source_size.y, border);
+        if (y < 0) {
+            memset(destination, 0, sizeof(Pixel)*image.size.x);
+            return;
+        }
+
+        auto source = source_pixels + (umm)y*source_size.x;
+        for (s32 i = 0; i < padding; ++i) {
+            destination[i] = columns[i] < 0 ? Pixel{} : source[columns[i]];
+            destination[padding + source_size.x + i] = columns[padding + i] < 0 ? Pixel{} : source[columns[padding + i]];
+        }
+        memcpy(destination + padding, source, sizeof(Pixel)*source_size.x);
+    });
+
+    return image;
+}
+
+// Pointer to the pixel at source coordinates `x`, `y`, which may be up to `padding` outside.
+Pixel *get_pixel(PaddedImage &image, s32 x, s32 y) {
+    return image.pixels + (umm)(y + image.padding)*image.size.x + x + image.padding;
+}
+
+// Crossover points between variants of a filter that give identical output. These are the built-in values,
+// `--algo auto` replaces them with the ones `--calibrate` measured on this machine.
+//   *_specialized_max_radius: largest radius using the loops instantiated for a constant radius.
+//   kuwahara_direct_max_radius: largest radius summing columns directly instead of using summed-area tables.
+//   tile_window_bytes: windows of a whole row up to this size are scanned in rows, larger ones in tiles.
+#define ENUMERATE_TUNING(e) \
+    e(s32, median_specialized_max_radius, 5) \
+    e(s32, bilateral_specialized_max_radius, 5) \
+    e(s32, kuwahara_direct_max_radius, 5) \
+    e(s32, tile_window_bytes, 0) \
+
+struct Tuning {
+    ENUMERATE_TUNING(_DEFINE_MEMBER)
+};
+
+static Tuning tuning;
+
+// Reads `<name> <value>` lines written by `save_tuning`. Lines starting with '#' are comments.
+bool load_tuning(Span<utf8> path) {
+    auto buffer = read_entire_file(path);
+    if (!buffer.data) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Failed to read tuning file '{}', run --calibrate to create it\n", path);
+        return false;
+    }
+    defer { free(buffer); };
+
+    Tuning result = {};
+    Span<utf8> text = {(utf8 *)buffer.data, buffer.count};
+    while (text.count) {
+        umm line_end = 0;
+        while (line_end < text.count && text.data[line_end] != '\n')
+            ++line_end;
+        Span<utf8> line = {text.data, line_end};
+        text = text.skip(min(line_end + 1, text.count));
+
+        while (line.count && (line.data[line.count - 1] == '\r' || line.data[line.count - 1] == ' '))
+            --line.count;
+        if (!line.count || line.data[0] == '#')
+            continue;
+
+        umm separator = 0;
+        while (separator < line.count && line.data[separator] != ' ')
+            ++separator;
+        Span<utf8> name = {line.data, separator};
+        Span<utf8> value = line.skip(min(separator + 1, line.count));
+
+        #define _LOAD_TUNING(type, member, default) \
+            else if (name == u8###member##s) { \
+                if (!parse_option(name, value, &result.member)) \
+                    return false; \
+            }
+        if (false) {}
+        ENUMERATE_TUNING(_LOAD_TUNING)
+        else {
+            with(ConsoleColor::red, print("Warning: "));
+            print("Unknown tuning '{}' in '{}', ignoring\n", name, path);
+        }
+        #undef _LOAD_TUNING
+    }
+
+    tuning = result;
+    return true;
+}
+
+v2s tile_size = {};
+
+// Source bytes the window of one tile may take. About the L2 of one core, so a tile's window stays cached
+// while all its outputs are computed. Plain rows of wide images with large windows don't fit.
+constexpr s32 tile_cache_bytes = 256*1024;
+
+// Square output tile whose window, the tile grown by `radius` on every side, takes `tile_cache_bytes`
+// at `bytes_per_pixel`. Whole rows while their window is within `tuning.tile_window_bytes`.
+v2s get_tile_size(v2s size, s32 radius, s32 bytes_per_pixel) {
+    if (tile_size.x > 0 && tile_size.y > 0)
+        return tile_size;
+
+    if ((s64)(radius*2 + 1)*(size.x + radius*2)*bytes_per_pixel <= tuning.tile_window_bytes)
+        return {size.x, 1};
+
+    s32 side = max((s32)sqrtf((f32)(tile_cache_bytes / bytes_per_pixel)) - radius*2, 16);
+    return {side, side};
+}
+
+// Calls `fn(tile_min, tile_max, thread_index)` for tiles covering `size`. Threads take tiles in row-major
+// order, so tiles running at the same time share source rows in the last level cache.
+template <class Fn>
+void for_each_tile(v2s size, v2s tile, Fn &&fn) {
+    tile = {clamp(tile.x, 1, max(size.x, 1)), clamp(tile.y, 1, max(size.y, 1))};
+    v2s tile_count = (size + tile - 1) / tile;
+    parallel_for(tile_count.x*tile_count.y, [&](s32 index, s32 thread_index) {
+        v2s tile_min = v2s{index % tile_count.x, index / tile_count.x} * tile;
+        v2s tile_max = tile_min + tile;
+        if (thread_index == 0)
+            report_progress(tile_min.y, size.y);
+        fn(tile_min, v2s{min(tile_max.x, size.x), min(tile_max.y, size.y)}, thread_index);
+    });
+}
+
+// Half width of row `oy` of a circular window, the widest run with `ox*ox + oy*oy <= radius*radius`.
+constexpr s32 get_circle_half_width(s32 radius, s32 oy) {
+    s32 half_width = 0;
+    while ((half_width + 1)*(half_width + 1) + oy*oy <= radius*radius)
+        ++half_width;
+    return half_width;
+}
+
+// Shape of a circular window with a radius known at compile time. Rows are listed from top to bottom,
+// `offsets` has every sample in row-major order.
+template <s32 radius>
+struct CircleWindow {
+    static constexpr s32 row_count = radius*2 + 1;
+
+    static constexpr std::array<s32, row_count> half_widths = [] {
+        std::array<s32, row_count> result = {};
+        for (s32 i = 0; i < row_count; ++i)
+            result[i] = get_circle_half_width(radius, i - radius);
+        return result;
+    }();
+
+    // Index of the first sample of each row.
+    static constexpr std::array<s32, row_count> row_starts = [] {
+        std::array<s32, row_count> result = {};
+        for (s32 i = 1; i < row_count; ++i)
+            result[i] = result[i - 1] + half_widths[i - 1]*2 + 1;
+        return result;
+    }();
+
+    static constexpr s32 area = row_starts[row_count - 1] + half_widths[row_count - 1]*2 + 1;
+
+    struct Offset {
+        s32 x;
+        s32 y;
+    };
+
+    static constexpr std::array<Offset, area> offsets = [] {
+        std::array<Offset, area> result = {};
+        s32 i = 0;
+        for (s32 oy = -radius; oy <= radius; ++oy) {
+            s32 half_width = half_widths[oy + radius];
+            for (s32 ox = -half_width; ox <= half_width; ++ox)
+                result[i++] = {ox, oy};
+        }
+        return result;
+    }();
+};
+
+// Most runs use a radius between 1 and 5. Filters instantiate their window loops for those radii, so that
+// window shapes are constants and loops over them can be fully unrolled. Calls `fn.template operator()<radius>()`
+// for these radii up to `max_radius` and `fn.template operator()<0>()`, the generic loop, for all others.
+template <class Fn>
+void dispatch_small_radius(s32 radius, s32 max_radius, Fn &&fn) {
+    switch (radius <= max_radius ? radius : 0) {
+        case 1:  fn.template operator()<1>(); break;
+        case 2:  fn.template operator()<2>(); break;
+        case 3:  fn.template operator()<3>(); break;
+        case 4:  fn.template operator()<4>(); break;
+        case 5:  fn.template operator()<5>(); break;
+        default: fn.template operator()<0>(); break;
+    }
+}
+
+// Kuwahara filter for small radii without summed-area tables. For every output row, column sums of the
+// `radius + 1` rows above and below it are taken first, quadrants then add `radius + 1` of these columns.
+// Results are identical to the table version, but the tables' memory traffic is gone, and so is the padded copy
+// of the source: rows and columns outside the image are mapped once per row.
+template <s32 radius>
+void kuwahara_small(Pixel *source_pixels, v2s source_size, Pixel *destination_pixels, v2s destination_size, Border border) {
+    constexpr s32 quadrant_width = radius + 1;
+    constexpr u32 quadrant_area = quadrant_width*quadrant_width;
+
+    // Columns are padded by `radius` on both sides.
+    s32 band_width = source_size.x + radius*2;
+
+    s32 edge_columns[radius*2];
+    for (s32 i = 0; i < radius; ++i) {
+        edge_columns[i] = get_border_coordinate(i - radius, source_size.x, border);
+        edge_columns[radius + i] = get_border_coordinate(source_size.x + i, source_size.x, border);
+    }
+
+    struct Band {
+        v4u32 *sums;
+        v4u32 *squares;
+    };
+
+    auto all_columns = current_allocator.allocate<v4u32>((umm)band_width*4*thread_pool.thread_count);
+    defer { current_allocator.free(all_columns); };
+
+    parallel_for(source_size.y, [&](s32 py, s32 thread_index) {
+        if (thread_index == 0)
+            report_progress(py, source_size.y);
+
+        auto columns = all_columns + (umm)band_width*4*thread_index;
+        Band bands[2] = {
+            {columns + band_width*0, columns + band_width*1},
+            {columns + band_width*2, columns + band_width*3},
+        };
+
+        // Transparent rows are null.
+        Pixel *rows[radius*2 + 1];
+        for (s32 oy = -radius; oy <= radius; ++oy) {
+            s32 y = get_border_coordinate(py + oy, source_size.y, border);
+            rows[oy + radius] = y < 0 ? 0 : source_pixels + y*source_size.x;
+        }
+
+        // Top band is rows -radius to 0, bottom band is rows 0 to radius.
+        for (s32 b = 0; b < 2; ++b) {
+            auto band_rows = rows + b*radius;
+            auto sums = bands[b].sums + radius;
+            auto squares = bands[b].squares + radius;
+            for (s32 x = 0; x < source_size.x; ++x) {
+                v4u32 sum = {};
+                v4u32 square = {};
+                for (s32 row = 0; row < quadrant_width; ++row) {
+                    if (!band_rows[row])
+                        continue;
+                    auto p = (v4u32)band_rows[row][x];
+                    sum += p;
+                    square += p*p;
+                }
+                sums[x] = sum;
+                squares[x] = square;
+            }
+            for (s32 i = 0; i < radius*2; ++i) {
+                s32 x = edge_columns[i];
+                s32 column = i < radius ? i - radius : source_size.x + i - radius;
+                sums[column] = x < 0 ? v4u32{} : sums[x];
+                squares[column] = x < 0 ? v4u32{} : squares[x];
+            }
+        }
+
+        for (s32 px = 0; px < source_size.x; ++px) {
+            v4u32 min_sum = {};
+            s64 min_variance = 0;
+
+            // Same quadrant order as the table version: top left, top right, bottom left, bottom right.
+            for (s32 i = 0; i < 4; ++i) {
+                auto &band = bands[i / 2];
+                s32 first = px + (i % 2)*radius;
+
+                v4u32 sum = {};
+                v4u32 square = {};
+                for (s32 column = 0; column < quadrant_width; ++column) {
+                    sum += band.sums[first + column];
+                    square += band.squares[first + column];
+                }
+
+                s64 variance =
+                    (s64)quadrant_area*((s64)square.x + square.y + square.z + square.w)
+                    - ((s64)sum.x*sum.x + (s64)sum.y*sum.y + (s64)sum.z*sum.z + (s64)sum.w*sum.w);
+
+                if (i == 0 || variance < min_variance) {
+                    min_variance = variance;
+                    min_sum = sum;
+                }
+            }
+
+            destination_pixels[py*destination_size.x + px] = (Pixel)(min_sum / quadrant_area);
+        }
+    });
+}
+
+// Gaussian bilateral filter over a circular window. Spatial weights are a table of taps built once per image,
+// range weights are looked up by the integer Manhattan distance of RGB, so the inner loop only adds
+// differences and multiplies two weights.
+void bilateral_gaussian(PaddedImage &source, v2s source_size, Pixel *destination_pixels, v2s destination_size, s32 radius, f32 sigma_s, f32 sigma_r) {
+    struct Tap {
+        s32 offset;
+        f32 weight;
+    };
+
+    List<Tap> taps;
+    defer { free(taps); };
+
+    for (s32 oy = -radius; oy <= radius; ++oy) {
+        s32 half_width = get_circle_half_width(radius, oy);
+        for (s32 ox = -half_width; ox <= half_width; ++ox) {
+            taps.add({
+                .offset = oy*source.size.x + ox,
+                .weight = expf(-(f32)(ox*ox + oy*oy) / (2*sigma_s*sigma_s)),
+            });
+        }
+    }
+
+    f32 range_weights[255*3 + 1];
+    for (umm d = 0; d < count_of(range_weights); ++d) {
+        range_weights[d] = expf(-(f32)(d*d) / (2*sigma_r*sigma_r));
+    }
+
+    for_each_tile(source_size, get_tile_size(source_size, radius, sizeof(Pixel)), [&](v2s tile_min, v2s tile_max, s32) {
+        for (s32 py = tile_min.y; py < tile_max.y; ++py)
+        for (s32 px = tile_min.x; px < tile_max.x; ++px) {
+            auto center = get_pixel(source, px, py);
+            s32 cr = center->x, cg = center->y, cb = center->z;
+
+            v4f sum = {};
+            f32 den = 0;
+            for (auto tap : taps) {
+                auto p = center[tap.offset];
+                s32 d = absolute(p.x - cr) + absolute(p.y - cg) + absolute(p.z - cb);
+                f32 w = tap.weight * range_weights[d];
+                sum += (v4f)p * w;
+                den += w;
+            }
+
+            destination_pixels[py*destination_size.x + px] = (Pixel)(sum / den);
+        }
+    });
+}
+
+// Replaces every value of a line with the extreme of the `half*2 + 1` values around it (van Herk / Gil-Werman).
+// The line is cut into blocks of the window size. Running extremes from the start of each block and from its end
+// give every window as the extreme of two values, about three `op`s per value for any window size.
+// Values beyond the line read `identity`. `scratch` needs room for 3*(count + half*4 + 1) values.
+template <class T, class Op>
+void running_extreme(T *values, s32 count, s32 stride, s32 half, T identity, Op op, T *scratch) {
+    s32 window = half*2 + 1;
+    s32 total = (count + half*2 + window - 1) / window * window;
+
+    auto f = scratch;
+    auto g = f + total;
+    auto h = g + total;
+
+    for (s32 i = 0; i < half; ++i)
+        f[i] = identity;
+    for (s32 i = 0; i < count; ++i)
+        f[half + i] = values[(smm)i*stride];
+    for (s32 i = half + count; i < total; ++i)
+        f[i] = identity;
+
+    for (s32 block = 0; block < total; block += window) {
+        g[block] = f[block];
+        for (s32 i = block + 1; i < block + window; ++i)
+            g[i] = op(g[i - 1], f[i]);
+
+        h[block + window - 1] = f[block + window - 1];
+        for (s32 i = block + window - 2; i >= block; --i)
+            h[i] = op(h[i + 1], f[i]);
+    }
+
+    for (s32 i = 0; i < count; ++i)
+        values[(smm)i*stride] = op(h[i], g[i + window - 1]);
+}
+
+// Min or max filter over a square, or a disk approximated by an octagon with the same horizontal and vertical
+// extent. The octagon is the sum of horizontal, vertical and both diagonal lines, so every pass is a
+// `running_extreme` and the cost does not depend on the radius. `get` turns pixels into values, `put` writes
+// a value back into the source pixel.
+template <class T, class Op, class Get, class Put>
+void morphology(Pixel *source_pixels, v2s source_size, Pixel *destination_pixels, s32 radius, WindowShape shape, Border border,
+                       T identity, Op op, Get get, Put put) {
+    s32 diagonal = shape.value == WindowShape::disk ? (s32)(radius * (1 - 1/sqrtf(2))) : 0;
+    s32 straight = radius - diagonal*2;
+
+    // Passes run on the padded image. Windows of all passes together reach `radius`, so values near the
+    // padded edges that see less than a full window never reach the image.
+    v2s size = source_size + radius*2;
+    auto values = current_allocator.allocate<T>((umm)size.x*size.y, 64);
+    defer { current_allocator.free(values); };
+
+    parallel_for(size.y, [&](s32 ty, s32) {
+        s32 y = get_border_coordinate(ty - radius, source_size.y, border);
+        for (s32 tx = 0; tx < size.x; ++tx) {
+            s32 x = get_border_coordinate(tx - radius, source_size.x, border);
+            values[(umm)ty*size.x + tx] = get(x < 0 || y < 0 ? Pixel{} : source_pixels[y*source_size.x + x]);
+        }
+    });
+
+    s32 longest = max(size.x, size.y);
+    s32 scratch_size = 3*(longest + max(straight, diagonal)*4 + 1);
+    auto all_scratch = current_allocator.allocate<T>((umm)scratch_size*thread_pool.thread_count);
+    defer { current_allocator.free(all_scratch); };
+
+    // Line `i` of a pass starts on the top row for i < size.x, otherwise on the left or right column.
+    auto run_pass = [&](s32 line_count, s32 half, auto &&get_line) {
+        if (half <= 0)
+            return;
+        parallel_for(line_count, [&](s32 line, s32 thread_index) {
+            v2s start;
+            s32 count, stride;
+            get_line(line, &start, &count, &stride);
+            running_extreme(values + (umm)start.y*size.x + start.x, count, stride, half, identity, op, all_scratch + (umm)scratch_size*thread_index);
+        });
+    };
+
+    run_pass(size.y, straight, [&](s32 line, v2s *start, s32 *count, s32 *stride) {
+        *start = {0, line};
+        *count = size.x;
+        *stride = 1;
+    });
+    run_pass(size.x, straight, [&](s32 line, v2s *start, s32 *count, s32 *stride) {
+        *start = {line, 0};
+        *count = size.y;
+        *stride = size.x;
+    });
+    run_pass(size.x + size.y - 1, diagonal, [&](s32 line, v2s *start, s32 *count, s32 *stride) {
+        *start = line < size.x ? v2s{line, 0} : v2s{0, line - size.x + 1};
+        *count = min(size.x - start->x, size.y - start->y);
+        *stride = size.x + 1;
+    });
+    run_pass(size.x + size.y - 1, diagonal, [&](s32 line, v2s *start, s32 *count, s32 *stride) {
+        *start = line < size.x ? v2s{line, 0} : v2s{size.x - 1, line - size.x + 1};
+        *count = min(start->x + 1, size.y - start->y);
+        *stride = size.x - 1;
+    });
+
+    parallel_for(source_size.y, [&](s32 y, s32) {
+        for (s32 x = 0; x < source_size.x; ++x) {
+            s32 i = y*source_size.x + x;
+            destination_pixels[i] = put(source_pixels[i], values[(umm)(y + radius)*size.x + x + radius]);
+        }
+    });
+}
+
+template <class Op>
+void morphology(Pixel *source_pixels, v2s source_size, Pixel *destination_pixels, s32 radius, WindowShape shape, Border border,
+                       MorphologyChannel channel, bool maximum, Op op) {
+    switch (channel.value) {
+        case MorphologyChannel::alpha:
+            morphology(source_pixels, source_size, destination_pixels, radius, shape, border, (u8)(maximum ? 0 : 255), op,
+                [](Pixel p) { return p.w; },
+                [](Pixel p, u8 alpha) { p.w = alpha; return p; });
+            break;
+        case MorphologyChannel::luma:
+            // Luma above the pixel itself, so comparing keys compares luma first.
+            morphology(source_pixels, source_size, destination_pixels, radius, shape, border, (u64)(maximum ? 0 : ~0ull), op,
+                [](Pixel p) {
+                    u32 bits;
+                    memcpy(&bits, &p, sizeof(bits));
+                    return (u64)clamp((s32)dot((v3f)p.xyz, v3f{0.299f, 0.587f, 0.114f}), 0, 255) << 32 | bits;
+                },
+                [](Pixel, u64 key) {
+                    Pixel p;
+                    u32 bits = (u32)key;
+                    memcpy(&p, &bits, sizeof(p));
+                    return p;
+                });
+            break;
+        case MorphologyChannel::rgba:
+            morphology(source_pixels, source_size, destination_pixels, radius, shape, border, maximum ? Pixel{} : Pixel{255, 255, 255, 255}, op,
+                [](Pixel p) { return p; },
+                [](Pixel, Pixel p) { return p; });
+            break;
+    }
+}
+
+List<Filter> filters;
+
+void free(Pipeline &pipeline) {
+    for (auto &stage : pipeline.stages) {
+        current_allocator.free(stage.state);
+    }
+    free(pipeline.stages);
+}
+
+void free(PipelineBuffers &buffers) {
+    for (auto pixels : buffers.pixels) {
+        if (pixels)
+            current_allocator.free(pixels);
+    }
+    free(buffers.cache);
+    buffers = {};
+}
+
+s32 parse_pipeline(Span<Span<utf8>> args, Pipeline &pipeline) {
+    auto timer = create_precise_timer();
+    defer { add_time(Phase::parse, timer); };
+
+    while (args.count) {
+        umm stage_arg_count = 0;
+        while (stage_arg_count < args.count && args[stage_arg_count] != u8"--"s)
+            ++stage_arg_count;
+
+        if (stage_arg_count == 0) {
+            with(ConsoleColor::red, print("Error: "));
+            print("Expected a filter name\n");
+            return 2;
+        }
+
+        auto filter_name = args[0];
+
+        auto found_filter = find_if(filters, [&](auto filter){return filter.name == filter_name;});
+        if (!found_filter) {
+            with(ConsoleColor::red, print("Error: "));
+            print("Filter '{}' not found\n", filter_name);
+            return 2;
+        }
+
+        Stage stage = {
+            .filter = *found_filter,
+            .state = current_allocator.allocate<u8>(filter_state_size),
+        };
+        pipeline.stages.add(stage);
+
+        if (!stage.filter.parse({args.data + 1, stage_arg_count - 1}, stage.state)) {
+            return 3;
+        }
+
+        args = args.skip(min(stage_arg_count + 1, args.count));
+    }
+    return 0;
+}
+
+bool apply_pipeline(Pipeline &pipeline, Pixel *source_pixels, v2s source_size, PipelineBuffers &buffers, Pixel **result, v2s *result_size,
+                    Pixel *final_destination) {
+    // Offset tables are built while applying, keep their time out of the apply phase.
+    auto timer = create_precise_timer();
+    f64 offset_table_seconds = stats.seconds[(umm)Phase::offset_table];
+    defer {
+        stats.seconds[(umm)Phase::apply] += get_time(timer) - (stats.seconds[(umm)Phase::offset_table] - offset_table_seconds);
+    };
+
+    Pixel *stage_source = source_pixels;
+    v2s stage_source_size = source_size;
+
+    for (umm i = 0; i < pipeline.stages.count; ++i) {
+        auto &stage = pipeline.stages[i];
+        auto destination_size = stage.filter.get_destination_size(stage_source_size, stage.state);
+
+        Pixel *destination_pixels = final_destination;
+        if (!final_destination || i + 1 < pipeline.stages.count) {
+            auto &buffer = buffers.pixels[i % 2];
+            auto &capacity = buffers.capacities[i % 2];
+            umm pixel_count = (umm)destination_size.x*destination_size.y;
+            if (capacity < pixel_count) {
+                if (buffer)
+                    current_allocator.free(buffer);
+                buffer = current_allocator.allocate<Pixel>(pixel_count);
+                capacity = pixel_count;
+            }
+            destination_pixels = buffer;
+        }
+
+        if (pipeline.stages.count > 1)
+            verbose_print("{}\n", stage.filter.name);
+
+        if (!stage.filter.apply(stage_source, stage_source_size, destination_pixels, destination_size, buffers.cache, stage.state)) {
+            return false;
+        }
+
+        stage_source = destination_pixels;
+        stage_source_size = destination_size;
+    }
+
+    *result = stage_source;
+    *result_size = stage_source_size;
+    return true;
+}
+
+// Binary netpbm images (P6, and P7 with 3 or 4 channels) are stored uncompressed, so they can be
+// read and written a few rows at a time. Strip processing uses them to keep huge images out of memory.
+struct NetpbmFile {
+    FILE *file = 0;
+    v2s size = {};
+    s32 channels = 0;
+    s64 data_offset = 0;
+    u8 *row_buffer = 0;
+};
+
+void free(NetpbmFile &image) {
+    if (image.file)
+        fclose(image.file);
+    if (image.row_buffer)
+        current_allocator.free(image.row_buffer);
+    image = {};
+}
+
+std::filesystem::path to_path(Span<utf8> path) {
+    return std::u8string((char8_t *)path.data, path.count);
+}
+
+s32 seek(FILE *file, s64 offset) {
+#ifdef _WIN32
+    return _fseeki64(file, offset, SEEK_SET);
+#else
+    return fseeko(file, offset, SEEK_SET);
+#endif
+}
+
+// Images with more pixels are treated as corrupt by the loaders, 16GB of RGBA. Below this, pixel and byte
+// counts of an image fit in u64 without overflow.
+constexpr u64 max_image_pixels = (u64)1 << 32;
+
+// Parses a P6 or P7 header, `data_offset` is where the rows start.
+bool parse_netpbm_header(u8 const *data, umm count, v2s *size, s32 *channels, umm *data_offset) {
+    if (count < 2 || data[0] != 'P' || (data[1] != '6' && data[1] != '7'))
+        return false;
+
+    umm cursor = 2;
+
+    // Reads the next whitespace separated token, skipping comments.
+    // The single whitespace character after the token is consumed too, which is where pixel data starts.
+    char token[32];
+    auto read_token = [&] {
+        while (cursor < count && (isspace(data[cursor]) || data[cursor] == '#')) {
+            if (data[cursor] == '#') {
+                while (cursor < count && data[cursor] != '\n')
+                    ++cursor;
+            } else {
+                ++cursor;
+            }
+        }
+
+        s32 length = 0;
+        while (cursor < count && !isspace(data[cursor]) && length < (s32)sizeof(token) - 1)
+            token[length++] = (char)data[cursor++];
+        token[length] = 0;
+
+        if (cursor < count)
+            ++cursor;
+        return length != 0;
+    };
+
+    // Like atoi, but values that don't fit in s32 become -1 and fail the checks below.
+    auto parse_token = [&] {
+        auto value = strtoll(token, 0, 10);
+        return value < 0 || value > 0x7fffffff ? -1 : (s32)value;
+    };
+
+    s32 max_value = 0;
+    *size = {};
+    *channels = 0;
+    if (data[1] == '6') {
+        *channels = 3;
+        if (!read_token())
+            return false;
+        size->x = parse_token();
+        if (!read_token())
+            return false;
+        size->y = parse_token();
+        if (!read_token())
+            return false;
+        max_value = parse_token();
+    } else {
+        while (true) {
+            if (!read_token())
+                return false;
+            if (!strcmp(token, "ENDHDR"))
+                break;
+
+            char key[32];
+            strcpy(key, token);
+            if (!read_token())
+                return false;
+
+            if      (!strcmp(key, "WIDTH"))  size->x = parse_token();
+            else if (!strcmp(key, "HEIGHT")) size->y = parse_token();
+            else if (!strcmp(key, "DEPTH"))  *channels = parse_token();
+            else if (!strcmp(key, "MAXVAL")) max_value = parse_token();
+        }
+    }
+
+    *data_offset = cursor;
+    return max_value == 255 && (*channels == 3 || *channels == 4) && size->x > 0 && size->y > 0
+        && (u64)size->x*size->y <= max_image_pixels;
+}
+
+bool open_netpbm(Span<utf8> path, NetpbmFile &image) {
+    image = {};
+    image.file = fopen(to_path(path).string().c_str(), "rb");
+    if (!image.file)
+        return false;
+
+    u8 header[4096];
+    umm header_size = fread(header, 1, sizeof(header), image.file);
+
+    umm data_offset;
+    if (!parse_netpbm_header(header, header_size, &image.size, &image.channels, &data_offset)) {
+        free(image);
+        return false;
+    }
+
+    image.data_offset = data_offset;
+    image.row_buffer = current_allocator.allocate<u8>((umm)image.size.x*image.channels);
+    return true;
+}
+
+bool read_netpbm_rows(NetpbmFile &image, s32 y, s32 count, Pixel *pixels) {
+    auto timer = create_precise_timer();
+    defer { add_time(Phase::read, timer); };
+
+    umm row_size = (umm)image.size.x*image.channels;
+    if (seek(image.file, image.data_offset + (s64)y*row_size))
+        return false;
+
+    if (image.channels == 4)
+        return fread(pixels, row_size, count, image.file) == (umm)count;
+
+    for (s32 row = 0; row < count; ++row) {
+        if (fread(image.row_buffer, row_size, 1, image.file) != 1)
+            return false;
+        auto row_pixels = pixels + (umm)row*image.size.x;
+        for (s32 x = 0; x < image.size.x; ++x) {
+            row_pixels[x] = {image.row_buffer[x*3 + 0], image.row_buffer[x*3 + 1], image.row_buffer[x*3 + 2], 255};
+        }
+    }
+    return true;
+}
+
+// Output is written in row batches through `ImageWriter`, so strips can be encoded as soon as they are done.
+// Format is taken from --output-format if given, otherwise from the extension, png by default.
+bool output_format_set = false;
+ImageFormat output_format = {ImageFormat::png};
+s32 png_level = 6;
+
+ImageFormat get_output_format(Span<utf8> path) {
+    if (output_format_set)
+        return output_format;
+
+    auto extension = to_path(path).extension().u8string();
+    for (auto &c : extension)
+        c = (char8_t)tolower(c);
+    if (extension == u8".qoi") return {ImageFormat::qoi};
+    if (extension == u8".raw" || extension == u8".rgba") return {ImageFormat::raw};
+    if (extension == u8".ppm") return {ImageFormat::ppm};
+    if (extension == u8".pam") return {ImageFormat::pam};
+    return {ImageFormat::png};
+}
+
+Span<utf8> get_extension(ImageFormat format) {
+    switch (format.value) {
+        case ImageFormat::png: return u8".png"s;
+        case ImageFormat::qoi: return u8".qoi"s;
+        case ImageFormat::raw: return u8".raw"s;
+        case ImageFormat::ppm: return u8".ppm"s;
+        case ImageFormat::pam: return u8".pam"s;
+    }
+    return u8".png"s;
+}
+
+// Minimal deflate encoder for png. Row blocks are compressed independently with fixed Huffman codes
+// and end on a byte boundary (sync flush), so they can be done in parallel and simply concatenated.
+// Level 0 writes stored blocks, higher levels search longer hash chains.
+
+struct BitWriter {
+    List<u8> bytes;
+    u64 bits = 0;
+    s32 bit_count = 0;
+};
+
+void put_bits(BitWriter &writer, u32 value, s32 count) {
+    writer.bits |= (u64)value << writer.bit_count;
+    writer.bit_count += count;
+    while (writer.bit_count >= 8) {
+        writer.bytes.add((u8)writer.bits);
+        writer.bits >>= 8;
+        writer.bit_count -= 8;
+    }
+}
+
+void align_to_byte(BitWriter &writer) {
+    if (writer.bit_count)
+        put_bits(writer, 0, 8 - writer.bit_count);
+}
+
+struct DeflateTables {
+    u16 literal_codes[288];
+    u8 literal_lengths[288];
+    u16 length_symbols[259];
+    u8 distance_symbols[512];
+    u16 length_bases[29];
+    u8 length_extra[29];
+    u16 distance_bases[30];
+    u8 distance_extra[30];
+
+    DeflateTables() {
+        auto reverse = [](u32 code, s32 length) {
+            u32 result = 0;
+            for (s32 i = 0; i < length; ++i)
+                result |= ((code >> i) & 1) << (length - 1 - i);
+            return (u16)result;
+        };
+        for (s32 i = 0; i < 288; ++i) {
+            if      (i < 144) { literal_lengths[i] = 8; literal_codes[i] = reverse(0x30  + i,       8); }
+            else if (i < 256) { literal_lengths[i] = 9; literal_codes[i] = reverse(0x190 + i - 144, 9); }
+            else if (i < 280) { literal_lengths[i] = 7; literal_codes[i] = reverse(0     + i - 256, 7); }
+            else              { literal_lengths[i] = 8; literal_codes[i] = reverse(0xc0  + i - 280, 8); }
+        }
+
+        s32 base = 3;
+        for (s32 i = 0; i < 28; ++i) {
+            length_extra[i] = i < 8 ? 0 : (i - 4) / 4;
+            length_bases[i] = base;
+            for (s32 j = 0; j < (1 << length_extra[i]); ++j)
+                length_symbols[base + j] = i;
+            base += 1 << length_extra[i];
+        }
+        length_extra[28] = 0;
+        length_bases[28] = 258;
+        length_symbols[258] = 28;
+
+        base = 1;
+        for (s32 i = 0; i < 30; ++i) {
+            distance_extra[i] = i < 4 ? 0 : (i - 2) / 2;
+            distance_bases[i] = base;
+            base += 1 << distance_extra[i];
+        }
+        // Distances up to 256 are looked up directly, larger ones by (distance - 1) >> 7.
+        for (s32 i = 0; i < 30; ++i) {
+            for (s32 d = distance_bases[i]; d < distance_bases[i] + (1 << distance_extra[i]); ++d) {
+                if (d <= 256)
+                    distance_symbols[d - 1] = i;
+                else
+                    distance_symbols[256 + ((d - 1) >> 7)] = i;
+            }
+        }
+    }
+};
+
+static DeflateTables const deflate_tables;
+
+void put_symbol(BitWriter &writer, s32 symbol) {
+    put_bits(writer, deflate_tables.literal_codes[symbol], deflate_tables.literal_lengths[symbol]);
+}
+
+// Appends `data` to `writer` as non-final deflate blocks ending on a byte boundary.
+void deflate_block(BitWriter &writer, u8 *data, s32 count, s32 level) {
+    if (level <= 0) {
+        for (s32 offset = 0; offset < count || offset == 0; offset += 65535) {
+            u16 length = (u16)min(count - offset, 65535);
+            put_bits(writer, 0, 3);
+            align_to_byte(writer);
+            put_bits(writer, length, 16);
+            put_bits(writer, (u16)~length, 16);
+            for (s32 i = 0; i < length; ++i)
+                writer.bytes.add(data[offset + i]);
+        }
+        return;
+    }
+
+    constexpr s32 window_size = 32768;
+    constexpr s32 hash_bits = 15;
+    constexpr s32 max_match = 258;
+
+    s32 max_chain = level <= 1 ? 4 : level <= 3 ? 8 : level <= 5 ? 32 : level <= 6 ? 128 : level <= 8 ? 512 : 4096;
+
+    auto heads = current_allocator.allocate<s32>(1 << hash_bits);
+    auto previous = current_allocator.allocate<s32>(window_size);
+    defer {
+        current_allocator.free(heads);
+        current_allocator.free(previous);
+    };
+    memset(heads, -1, sizeof(s32) << hash_bits);
+
+    auto hash = [&](s32 i) {
+        return ((data[i] << 16 | data[i + 1] << 8 | data[i + 2]) * 2654435761u) >> (32 - hash_bits);
+    };
+    auto insert = [&](s32 i) {
+        auto h = hash(i);
+        previous[i & (window_size - 1)] = heads[h];
+        heads[h] = i;
+    };
+
+    put_bits(writer, 0, 1);
+    put_bits(writer, 1, 2);
+
+    for (s32 i = 0; i < count;) {
+        s32 best_length = 0;
+        s32 best_distance = 0;
+
+        if (i + 3 <= count) {
+            s32 limit = min(max_match, count - i);
+            s32 candidate = heads[hash(i)];
+            for (s32 chain = 0; chain < max_chain && candidate >= 0 && i - candidate <= window_size; ++chain) {
+                if (data[candidate + best_length] == data[i + best_length]) {
+                    s32 length = 0;
+                    while (length < limit && data[candidate + length] == data[i + length])
+                        ++length;
+                    if (length > best_length) {
+                        best_length = length;
+                        best_distance = i - candidate;
+                        if (length == limit)
+                            break;
+                    }
+                }
+                candidate = previous[candidate & (window_size - 1)];
+            }
+        }
+
+        if (best_length >= 3) {
+            auto &t = deflate_tables;
+            s32 length_symbol = t.length_symbols[best_length];
+            put_symbol(writer, 257 + length_symbol);
+            put_bits(writer, best_length - t.length_bases[length_symbol], t.length_extra[length_symbol]);
+
+            s32 distance_symbol = best_distance <= 256 ? t.distance_symbols[best_distance - 1] : t.distance_symbols[256 + ((best_distance - 1) >> 7)];
+            u32 reversed = 0;
+            for (s32 b = 0; b < 5; ++b)
+                reversed |= ((distance_symbol >> b) & 1) << (4 - b);
+            put_bits(writer, reversed, 5);
+            put_bits(writer, best_distance - t.distance_bases[distance_symbol], t.distance_extra[distance_symbol]);
+
+            for (s32 match_end = i + best_length; i < match_end; ++i) {
+                if (i + 3 <= count)
+                    insert(i);
+            }
+        } else {
+            put_symbol(writer, data[i]);
+            if (i + 3 <= count)
+                insert(i);
+            ++i;
+        }
+    }
+
+    // End of block, then an empty stored block to get back to a byte boundary.
+    put_symbol(writer, 256);
+    put_bits(writer, 0, 3);
+    align_to_byte(writer);
+    put_bits(writer, 0, 16);
+    put_bits(writer, 0xffff, 16);
+}
+
+u32 adler32(u8 *data, umm count, u32 adler = 1) {
+    u32 a = adler & 0xffff;
+    u32 b = adler >> 16;
+    while (count) {
+        umm chunk = min(count, (umm)5552);
+        for (umm i = 0; i < chunk; ++i) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += chunk;
+        count -= chunk;
+    }
+    return b << 16 | a;
+}
+
+// Adler-32 of two concatenated buffers from their separate checksums, same as zlib's adler32_combine.
+u32 combine_adler32(u32 adler1, u32 adler2, u64 count2) {
+    u64 const base = 65521;
+    u64 remainder = count2 % base;
+    u64 sum1 = adler1 & 0xffff;
+    u64 sum2 = remainder * sum1 % base;
+    sum1 += (adler2 & 0xffff) + base - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + base - remainder;
+    if (sum1 >= base) sum1 -= base;
+    if (sum1 >= base) sum1 -= base;
+    if (sum2 >= base*2) sum2 -= base*2;
+    if (sum2 >= base) sum2 -= base;
+    return (u32)(sum2 << 16 | sum1);
+}
+
+struct Crc32Table {
+    u32 values[256];
+    Crc32Table() {
+        for (u32 i = 0; i < 256; ++i) {
+            u32 c = i;
+            for (s32 k = 0; k < 8; ++k)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            values[i] = c;
+        }
+    }
+};
+
+static Crc32Table const crc32_table;
+
+u32 crc32(u8 const *data, umm count, u32 crc = 0) {
+    crc = ~crc;
+    for (umm i = 0; i < count; ++i)
+        crc = crc32_table.values[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+void add_u32_be(List<u8> &bytes, u32 value) {
+    bytes.add((u8)(value >> 24));
+    bytes.add((u8)(value >> 16));
+    bytes.add((u8)(value >> 8));
+    bytes.add((u8)value);
+}
+
+// Seconds the calling thread spent in `write_bytes`, lets `write_rows` tell encoding and writing apart.
+static thread_local f64 thread_write_seconds = 0;
+
+bool write_bytes(FILE *file, void const *data, umm count) {
+    auto timer = create_precise_timer();
+    bool ok = count == 0 || fwrite(data, count, 1, file) == 1;
+    f64 seconds = get_time(timer);
+    thread_write_seconds += seconds;
+    stats.seconds[(umm)Phase::write] += seconds;
+    return ok;
+}
+
+bool write_png_chunk(FILE *file, char const *type, u8 const *data, umm count) {
+    u8 header[8] = {(u8)(count >> 24), (u8)(count >> 16), (u8)(count >> 8), (u8)count, (u8)type[0], (u8)type[1], (u8)type[2], (u8)type[3]};
+    u32 crc = crc32(data, count, crc32(header + 4, 4));
+    u8 footer[4] = {(u8)(crc >> 24), (u8)(crc >> 16), (u8)(crc >> 8), (u8)crc};
+    return write_bytes(file, header, 8)
+        && write_bytes(file, data, count)
+        && write_bytes(file, footer, 4);
+}
+
+// Writes one filter type byte and the filtered row. Level 0 skips filtering, otherwise every filter
+// is tried and the one with the smallest sum of absolute signed differences is kept.
+void filter_png_row(u8 *destination, u8 *trial, u8 const *row, u8 const *above, s32 count, s32 level) {
+    if (level <= 0) {
+        destination[0] = 0;
+        memcpy(destination + 1, row, count);
+        return;
+    }
+
+    u64 best_cost = ~(u64)0;
+    for (s32 type = 0; type < 5; ++type) {
+        for (s32 i = 0; i < count; ++i) {
+            s32 a = i >= 4 ? row[i - 4] : 0;
+            s32 b = above ? above[i] : 0;
+            s32 c = i >= 4 && above ? above[i - 4] : 0;
+            s32 prediction;
+            switch (type) {
+                case 0: prediction = 0; break;
+                case 1: prediction = a; break;
+                case 2: prediction = b; break;
+                case 3: prediction = (a + b) >> 1; break;
+                default: {
+                    s32 p = a + b - c;
+                    s32 pa = absolute(p - a);
+                    s32 pb = absolute(p - b);
+                    s32 pc = absolute(p - c);
+                    prediction = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                    break;
+                }
+            }
+            trial[i] = (u8)(row[i] - prediction);
+        }
+
+        u64 cost = 0;
+        for (s32 i = 0; i < count; ++i)
+            cost += absolute((s32)(s8)trial[i]);
+
+        if (cost < best_cost) {
+            best_cost = cost;
+            destination[0] = (u8)type;
+            memcpy(destination + 1, trial, count);
+        }
+    }
+}
+
+struct ImageWriter {
+    ImageFormat format = {};
+    FILE *file = 0;
+    v2s size = {};
+    List<u8> buffer;
+
+    // png
+    u8 *previous_row = 0;
+    u32 adler = 1;
+
+    // qoi
+    Pixel qoi_index[64] = {};
+    Pixel qoi_previous = {0, 0, 0, 255};
+    s32 qoi_run = 0;
+};
+
+void free(ImageWriter &writer) {
+    if (writer.file)
+        fclose(writer.file);
+    free(writer.buffer);
+    if (writer.previous_row)
+        current_allocator.free(writer.previous_row);
+    writer = {};
+}
+
+bool flush(ImageWriter &writer) {
+    bool ok = write_bytes(writer.file, writer.buffer.data, writer.buffer.count);
+    writer.buffer.count = 0;
+    return ok;
+}
+
+bool begin_image(ImageWriter &writer, Span<utf8> path, v2s size, ImageFormat format) {
+    writer = {};
+    writer.file = fopen(to_path(path).string().c_str(), "wb");
+    if (!writer.file)
+        return false;
+
+    writer.format = format;
+    writer.size = size;
+
+    auto &buffer = writer.buffer;
+    switch (format.value) {
+        case ImageFormat::png: {
+            u8 signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+            u8 header[13] = {
+                (u8)(size.x >> 24), (u8)(size.x >> 16), (u8)(size.x >> 8), (u8)size.x,
+                (u8)(size.y >> 24), (u8)(size.y >> 16), (u8)(size.y >> 8), (u8)size.y,
+                8, 6, 0, 0, 0,
+            };
+            u8 zlib_header[] = {0x78, 0x01};
+            // Filters of the first row see a row of zeros above it.
+            writer.previous_row = current_allocator.allocate<u8>(size.x*sizeof(Pixel));
+            memset(writer.previous_row, 0, size.x*sizeof(Pixel));
+            return write_bytes(writer.file, signature, sizeof(signature))
+                && write_png_chunk(writer.file, "IHDR", header, sizeof(header))
+                && write_png_chunk(writer.file, "IDAT", zlib_header, sizeof(zlib_header));
+        }
+        case ImageFormat::qoi: {
+            for (u8 c : {'q', 'o', 'i', 'f'})
+                buffer.add(c);
+            add_u32_be(buffer, size.x);
+            add_u32_be(buffer, size.y);
+            buffer.add(4);
+            buffer.add(0);
+            return flush(writer);
+        }
+        case ImageFormat::raw:
+            return true;
+        case ImageFormat::ppm:
+            return fprintf(writer.file, "P6\n%d %d\n255\n", size.x, size.y) > 0;
+        case ImageFormat::pam:
+            return fprintf(writer.file, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", size.x, size.y) > 0;
+    }
+    return false;
+}
+
+bool write_png_rows(ImageWriter &writer, Pixel *pixels, s32 count) {
+    s32 row_size = writer.size.x*sizeof(Pixel);
+
+    // Blocks of about 256KB keep most of the compression ratio and give every thread some work.
+    s32 rows_per_block = max(1, (256*1024) / (row_size + 1));
+    s32 block_count = (count + rows_per_block - 1) / rows_per_block;
+
+    struct Block {
+        BitWriter writer;
+        u32 adler;
+        umm filtered_count;
+    };
+    std::vector<Block> blocks(block_count);
+    defer {
+        for (auto &block : blocks)
+            free(block.writer.bytes);
+    };
+
+    parallel_for(block_count, [&](s32 block_index, s32) {
+        auto &block = blocks[block_index];
+        s32 first_row = block_index*rows_per_block;
+        s32 last_row = min(first_row + rows_per_block, count);
+
+        block.filtered_count = (umm)(last_row - first_row)*(row_size + 1);
+        auto filtered = current_allocator.allocate<u8>(block.filtered_count);
+        auto trial = current_allocator.allocate<u8>(row_size);
+        defer {
+            current_allocator.free(filtered);
+            current_allocator.free(trial);
+        };
+
+        for (s32 row = first_row; row < last_row; ++row) {
+            auto above = row ? (u8 *)(pixels + (umm)(row - 1)*writer.size.x) : writer.previous_row;
+            filter_png_row(filtered + (umm)(row - first_row)*(row_size + 1), trial, (u8 *)(pixels + (umm)row*writer.size.x), above, row_size, png_level);
+        }
+
+        block.adler = adler32(filtered, block.filtered_count);
+        block.writer.bytes.reserve(png_level <= 0 ? block.filtered_count + block.filtered_count/65535*5 + 5 : block.filtered_count/2);
+        deflate_block(block.writer, filtered, (s32)block.filtered_count, png_level);
+    });
+
+    for (auto &block : blocks) {
+        if (!write_png_chunk(writer.file, "IDAT", block.writer.bytes.data, block.writer.bytes.count))
+            return false;
+        writer.adler = combine_adler32(writer.adler, block.adler, block.filtered_count);
+    }
+
+    memcpy(writer.previous_row, pixels + (umm)(count - 1)*writer.size.x, row_size);
+    return true;
+}
+
+void write_qoi_pixels(ImageWriter &writer, Pixel *pixels, umm count) {
+    auto &buffer = writer.buffer;
+    auto as_u32 = [](Pixel p) {
+        u32 result;
+        memcpy(&result, &p, sizeof(result));
+        return result;
+    };
+    auto flush_run = [&] {
+        if (writer.qoi_run) {
+            buffer.add((u8)(0xc0 | (writer.qoi_run - 1)));
+            writer.qoi_run = 0;
+        }
+    };
+
+    for (umm i = 0; i < count; ++i) {
+        auto p = pixels[i];
+        auto &previous = writer.qoi_previous;
+
+        if (as_u32(p) == as_u32(previous)) {
+            if (++writer.qoi_run == 62)
+                flush_run();
+            continue;
+        }
+
+        flush_run();
+
+        s32 index = (p.x*3 + p.y*5 + p.z*7 + p.w*11) % 64;
+        if (as_u32(writer.qoi_index[index]) == as_u32(p)) {
+            buffer.add((u8)index);
+        } else {
+            writer.qoi_index[index] = p;
+            if (p.w == previous.w) {
+                s8 dr = (s8)(p.x - previous.x);
+                s8 dg = (s8)(p.y - previous.y);
+                s8 db = (s8)(p.z - previous.z);
+                s8 dr_dg = (s8)(dr - dg);
+                s8 db_dg = (s8)(db - dg);
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    buffer.add((u8)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+                } else if (dr_dg >= -8 && dr_dg <= 7 && dg >= -32 && dg <= 31 && db_dg >= -8 && db_dg <= 7) {
+                    buffer.add((u8)(0x80 | (dg + 32)));
+                    buffer.add((u8)((dr_dg + 8) << 4 | (db_dg + 8)));
+                } else {
+                    buffer.add(0xfe);
+                    buffer.add(p.x);
+                    buffer.add(p.y);
+                    buffer.add(p.z);
+                }
+            } else {
+                buffer.add(0xff);
+                buffer.add(p.x);
+                buffer.add(p.y);
+                buffer.add(p.z);
+                buffer.add(p.w);
+            }
+        }
+        previous = p;
+    }
+}
+
+bool write_rows(ImageWriter &writer, Pixel *pixels, s32 count) {
+    if (count <= 0)
+        return true;
+
+    auto timer = create_precise_timer();
+    f64 write_seconds = thread_write_seconds;
+    defer { stats.seconds[(umm)Phase::encode] += get_time(timer) - (thread_write_seconds - write_seconds); };
+
+    umm pixel_count = (umm)writer.size.x*count;
+    switch (writer.format.value) {
+        case ImageFormat::png:
+            return write_png_rows(writer, pixels, count);
+        case ImageFormat::qoi:
+            write_qoi_pixels(writer, pixels, pixel_count);
+            return flush(writer);
+        case ImageFormat::raw:
+        case ImageFormat::pam:
+            return write_bytes(writer.file, pixels, pixel_count*sizeof(Pixel));
+        case ImageFormat::ppm:
+            writer.buffer.reserve(pixel_count*3);
+            for (umm i = 0; i < pixel_count; ++i) {
+                writer.buffer.add(pixels[i].x);
+                writer.buffer.add(pixels[i].y);
+                writer.buffer.add(pixels[i].z);
+            }
+            return flush(writer);
+    }
+    return false;
+}
+
+// Finishes the file and closes it.
+bool end_image(ImageWriter &writer) {
+    bool ok = true;
+    switch (writer.format.value) {
+        case ImageFormat::png: {
+            // Final empty fixed Huffman block, then the checksum of all filtered rows.
+            u8 tail[] = {0x03, 0x00, (u8)(writer.adler >> 24), (u8)(writer.adler >> 16), (u8)(writer.adler >> 8), (u8)writer.adler};
+            ok = write_png_chunk(writer.file, "IDAT", tail, sizeof(tail))
+              && write_png_chunk(writer.file, "IEND", 0, 0);
+            break;
+        }
+        case ImageFormat::qoi: {
+            if (writer.qoi_run)
+                writer.buffer.add((u8)(0xc0 | (writer.qoi_run - 1)));
+            for (s32 i = 0; i < 7; ++i)
+                writer.buffer.add(0);
+            writer.buffer.add(1);
+            ok = flush(writer);
+            break;
+        }
+        default:
+            break;
+    }
+
+    ok = fclose(writer.file) == 0 && ok;
+    writer.file = 0;
+    return ok;
+}
+
+void free(MappedFile &mapped) {
+#ifdef _WIN32
+    if (mapped.data) UnmapViewOfFile(mapped.data);
+    if (mapped.mapping) CloseHandle(mapped.mapping);
+    if (mapped.file && mapped.file != INVALID_HANDLE_VALUE) CloseHandle(mapped.file);
+#else
+    if (mapped.data) munmap(mapped.data, mapped.size);
+#endif
+    mapped = {};
+}
+
+bool map_file(Span<utf8> path, MappedFile &mapped) {
+    mapped = {};
+#ifdef _WIN32
+    mapped.file = CreateFileW(to_path(path).c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    LARGE_INTEGER size;
+    if (mapped.file == INVALID_HANDLE_VALUE || !GetFileSizeEx(mapped.file, &size) || size.QuadPart == 0) {
+        free(mapped);
+        return false;
+    }
+    mapped.size = size.QuadPart;
+    mapped.mapping = CreateFileMappingW(mapped.file, 0, PAGE_WRITECOPY, 0, 0, 0);
+    if (mapped.mapping)
+        mapped.data = (u8 *)MapViewOfFile(mapped.mapping, FILE_MAP_COPY, 0, 0, 0);
+    if (!mapped.data) {
+        free(mapped);
+        return false;
+    }
+#else
+    s32 file = open(to_path(path).c_str(), O_RDONLY);
+    if (file == -1)
+        return false;
+    defer { close(file); };
+
+    struct stat status;
+    if (fstat(file, &status) || status.st_size == 0)
+        return false;
+
+    auto data = mmap(0, status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+    if (data == MAP_FAILED)
+        return false;
+
+    mapped.data = (u8 *)data;
+    mapped.size = status.st_size;
+#endif
+    return true;
+}
+
+v2s raw_input_size = {};
+
+bool is_raw_path(Span<utf8> path) {
+    auto extension = to_path(path).extension().u8string();
+    for (auto &c : extension)
+        c = (char8_t)tolower(c);
+    return extension == u8".raw" || extension == u8".rgba";
+}
+
+// Decodes qoi straight into `pixels`, which must hold size.x*size.y pixels.
+bool decode_qoi(u8 const *data, umm count, v2s size, Pixel *pixels) {
+    Pixel index[64] = {};
+    Pixel pixel = {0, 0, 0, 255};
+
+    umm cursor = 14;
+    umm end = count - 8;
+    umm pixel_count = (umm)size.x*size.y;
+    for (umm i = 0; i < pixel_count;) {
+        if (cursor >= end)
+            return false;
+
+        u8 tag = data[cursor++];
+        if (tag == 0xfe) {
+            if (cursor + 3 > end) return false;
+            pixel.x = data[cursor++];
+            pixel.y = data[cursor++];
+            pixel.z = data[cursor++];
+        } else if (tag == 0xff) {
+            if (cursor + 4 > end) return false;
+            pixel.x = data[cursor++];
+            pixel.y = data[cursor++];
+            pixel.z = data[cursor++];
+            pixel.w = data[cursor++];
+        } else if ((tag >> 6) == 0) {
+            pixel = index[tag];
+        } else if ((tag >> 6) == 1) {
+            pixel.x += ((tag >> 4) & 3) - 2;
+            pixel.y += ((tag >> 2) & 3) - 2;
+            pixel.z += ( tag       & 3) - 2;
+        } else if ((tag >> 6) == 2) {
+            if (cursor + 1 > end) return false;
+            s32 dg = (tag & 63) - 32;
+            u8 next = data[cursor++];
+            pixel.x += dg - 8 + (next >> 4);
+            pixel.y += dg;
+            pixel.z += dg - 8 + (next & 15);
+        } else {
+            umm run = min((umm)(tag & 63) + 1, pixel_count - i);
+            for (umm j = 0; j < run; ++j)
+                pixels[i++] = pixel;
+            continue;
+        }
+
+        index[(pixel.x*3 + pixel.y*5 + pixel.z*7 + pixel.w*11) % 64] = pixel;
+        pixels[i++] = pixel;
+    }
+    return true;
+}
+
+void free(Image &image) {
+    if (image.pixels && !image.in_place) {
+        if (image.from_stb)
+            stbi_image_free(image.pixels);
+        else
+            current_allocator.free(image.pixels);
+    }
+    free(image.mapping);
+    image = {};
+}
+
+s32 load_image(Span<utf8> path, Image &image) {
+    image = {};
+
+    // Mapping is cheap, pages are faulted in while decoding and count as decode time.
+    auto timer = create_precise_timer();
+    bool mapped = map_file(path, image.mapping);
+    add_time(Phase::read, timer);
+    if (!mapped) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Failed to read '{}'\n", path);
+        return 4;
+    }
+
+    reset(timer);
+    defer { add_time(Phase::decode, timer); };
+
+    auto data = image.mapping.data;
+    auto count = image.mapping.size;
+
+    auto fail = [&] {
+        free(image);
+        with(ConsoleColor::red, print("Error: "));
+        print("Failed to decode '{}'\n", path);
+        return 5;
+    };
+
+    s32 channels;
+    umm data_offset;
+    if (count >= 22 && !memcmp(data, "qoif", 4)) {
+        image.size.x = data[4] << 24 | data[5] << 16 | data[6] << 8 | data[7];
+        image.size.y = data[8] << 24 | data[9] << 16 | data[10] << 8 | data[11];
+        if (image.size.x <= 0 || image.size.y <= 0)
+            return fail();
+
+        // A byte of chunk data decodes to at most 62 pixels, larger sizes can't be backed by the file.
+        u64 pixel_count = (u64)image.size.x*image.size.y;
+        if (pixel_count > max_image_pixels || pixel_count > (count - 22)*62)
+            return fail();
+
+        image.pixels = current_allocator.allocate<Pixel>(pixel_count, 64);
+        if (!decode_qoi(data, count, image.size, image.pixels))
+            return fail();
+    } else if (parse_netpbm_header(data, count, &image.size, &channels, &data_offset)) {
+        umm pixel_count = (umm)image.size.x*image.size.y;
+        if (data_offset + pixel_count*channels > count)
+            return fail();
+
+        if (channels == 4) {
+            image.pixels = (Pixel *)(data + data_offset);
+            image.in_place = true;
+            return 0;
+        }
+
+        image.pixels = current_allocator.allocate<Pixel>(pixel_count, 64);
+        auto rgb = data + data_offset;
+        for (umm i = 0; i < pixel_count; ++i)
+            image.pixels[i] = {rgb[i*3 + 0], rgb[i*3 + 1], rgb[i*3 + 2], 255};
+    } else if (is_raw_path(path)) {
+        if (raw_input_size.x <= 0 || raw_input_size.y <= 0) {
+            free(image);
+            with(ConsoleColor::red, print("Error: "));
+            print("Size of raw input '{}' is unknown, pass --input-size <width>x<height>\n", path);
+            return 5;
+        }
+        if (count < (umm)raw_input_size.x*raw_input_size.y*sizeof(Pixel))
+            return fail();
+
+        image.size = raw_input_size;
+        image.pixels = (Pixel *)data;
+        image.in_place = true;
+        return 0;
+    } else {
+        image.pixels = (Pixel *)stbi_load_from_memory(data, count, &image.size.x, &image.size.y, 0, 4);
+        image.from_stb = true;
+        if (!image.pixels)
+            return fail();
+    }
+
+    // Decoded into a separate buffer, the file is not needed anymore.
+    free(image.mapping);
+    return 0;
+}
+
+// Reads only the header of an image `load_image` can decode.
+bool read_image_size(Span<utf8> path, v2s *size) {
+    MappedFile mapping;
+    if (!map_file(path, mapping))
+        return false;
+    defer { free(mapping); };
+
+    auto data = mapping.data;
+    auto count = mapping.size;
+
+    s32 channels;
+    umm data_offset;
+    if (count >= 22 && !memcmp(data, "qoif", 4)) {
+        *size = {
+            data[4] << 24 | data[5] << 16 | data[6] << 8 | data[7],
+            data[8] << 24 | data[9] << 16 | data[10] << 8 | data[11],
+        };
+    } else if (parse_netpbm_header(data, count, size, &channels, &data_offset)) {
+        return true;
+    } else if (is_raw_path(path)) {
+        *size = raw_input_size;
+    } else if (!stbi_info_from_memory(data, (int)count, &size->x, &size->y, &channels)) {
+        return false;
+    }
+    return size->x > 0 && size->y > 0;
+}
+
+void count_cached_image(Pipeline &pipeline, Span<utf8> input_path) {
+    v2s input_size;
+    if (!read_image_size(input_path, &input_size))
+        return;
+
+    auto output_size = input_size;
+    for (auto &stage : pipeline.stages)
+        output_size = stage.filter.get_destination_size(output_size, stage.state);
+    count_image(input_size, output_size);
+}
+
+s32 save_image(Span<utf8> path, Pixel *pixels, v2s size) {
+    ImageWriter writer;
+    defer { free(writer); };
+
+    bool ok = begin_image(writer, path, size, get_output_format(path))
+           && write_rows(writer, pixels, size.y)
+           && end_image(writer);
+
+    if (!ok) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Failed to write '{}'\n", path);
+        return 7;
+    }
+    return 0;
+}
+
+// Result cache, enabled by --cache. Outputs are stored under a hash of the input file's bytes, every stage's
+// filter name and parsed options, and everything else that changes the output file's bytes. A hit copies the
+// stored file, skipping decode, filters and encode. The least recently used files are deleted once the
+// directory grows beyond `cache_max_bytes`.
+Span<utf8> cache_directory = {};
+u64 cache_max_bytes = (u64)1 << 30;
+
+// Bump when filters change their output, old entries then stop matching.
+constexpr u32 cache_version = 1;
+
+// Two independent 64 bit lanes over 8 byte words, 128 bits in total.
+struct Hasher {
+    u64 a = 0x9e3779b97f4a7c15;
+    u64 b = 0xc2b2ae3d27d4eb4f;
+};
+
+u64 mix_hash(u64 x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccd;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53;
+    x ^= x >> 33;
+    return x;
+}
+
+void add_word(Hasher &hasher, u64 word) {
+    hasher.a = (hasher.a ^ word) * 0x100000001b3;
+    hasher.a = hasher.a << 29 | hasher.a >> 35;
+    hasher.b = (hasher.b + word) * 0x9e3779b97f4a7c15;
+    hasher.b ^= hasher.b >> 31;
+}
+
+void add_bytes(Hasher &hasher, void const *data, umm count) {
+    auto bytes = (u8 const *)data;
+    umm word_count = count / 8;
+    for (umm i = 0; i < word_count; ++i) {
+        u64 word;
+        memcpy(&word, bytes + i*8, 8);
+        add_word(hasher, word);
+    }
+
+    u64 tail = 0;
+    memcpy(&tail, bytes + word_count*8, count % 8);
+    add_word(hasher, tail);
+    add_word(hasher, count);
+}
+
+template <class T>
+void add_value(Hasher &hasher, T value) {
+    add_bytes(hasher, &value, sizeof(value));
+}
+
+CacheKey finish(Hasher &hasher) {
+    return {mix_hash(hasher.a ^ mix_hash(hasher.b)), mix_hash(hasher.b + hasher.a)};
+}
+
+bool get_cache_key(Pipeline &pipeline, Span<utf8> input_path, Span<utf8> output_path, CacheKey *key) {
+    auto timer = create_precise_timer();
+    defer { add_time(Phase::read, timer); };
+
+    MappedFile input;
+    if (!map_file(input_path, input))
+        return false;
+    defer { free(input); };
+
+    Hasher hasher;
+    add_value(hasher, cache_version);
+    add_bytes(hasher, input.data, input.size);
+    for (auto &stage : pipeline.stages) {
+        add_bytes(hasher, stage.filter.name.data, stage.filter.name.count);
+        stage.filter.hash(hasher, stage.state);
+    }
+
+    // Vector kernels round differently than scalar ones.
+    add_value(hasher, kernels.level.value);
+    add_value(hasher, get_output_format(output_path).value);
+    add_value(hasher, png_level);
+    if (is_raw_path(input_path))
+        add_value(hasher, raw_input_size);
+
+    *key = finish(hasher);
+    return true;
+}
+
+// Clones the file where the file system supports it, copies it otherwise. The copy is made next to `to` and renamed
+// over it, so `to` is left as it was on failure and other processes never see a partial file.
+bool clone_file(std::filesystem::path const &from, std::filesystem::path const &to) {
+    auto temporary_path = to;
+    temporary_path += ".tmp";
+
+    bool copied = false;
+#ifdef FICLONE
+    int source = open(from.c_str(), O_RDONLY);
+    if (source >= 0) {
+        defer { close(source); };
+        int destination = open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (destination >= 0) {
+            copied = ioctl(destination, FICLONE, source) == 0;
+            close(destination);
+        }
+    }
+#endif
+    std::error_code error;
+    if (!copied)
+        copied = std::filesystem::copy_file(from, temporary_path, std::filesystem::copy_options::overwrite_existing, error);
+    if (copied)
+        std::filesystem::rename(temporary_path, to, error);
+    if (!copied || error) {
+        std::filesystem::remove(temporary_path, error);
+        return false;
+    }
+    return true;
+}
+
+struct CacheEntry {
+    std::filesystem::path path;
+    std::filesystem::file_time_type used;
+    u64 size;
+};
+
+// Files in the cache directory, read once per process. Stores of this process are added.
+struct CacheIndex {
+    std::mutex mutex;
+    bool loaded = false;
+    std::vector<CacheEntry> entries;
+    u64 total_size = 0;
+};
+
+static CacheIndex cache_index;
+
+std::filesystem::path get_cache_path(CacheKey key) {
+    char name[33];
+    snprintf(name, sizeof(name), "%016llx%016llx", (unsigned long long)key.a, (unsigned long long)key.b);
+    return to_path(cache_directory) / name;
+}
+
+void load_cache_index() {
+    if (cache_index.loaded)
+        return;
+    cache_index.loaded = true;
+
+    std::error_code error;
+    std::filesystem::create_directories(to_path(cache_directory), error);
+    for (auto &entry : std::filesystem::directory_iterator(to_path(cache_directory), error)) {
+        if (!entry.is_regular_file(error) || entry.path().has_extension())
+            continue;
+        auto size = entry.file_size(error);
+        cache_index.entries.push_back({entry.path(), entry.last_write_time(error), size});
+        cache_index.total_size += size;
+    }
+}
+
+// Copies the cached output for `key` to `output_path`. Returns false on a miss.
+bool fetch_cached(CacheKey key, Span<utf8> output_path) {
+    auto timer = create_precise_timer();
+    auto cache_path = get_cache_path(key);
+
+    std::error_code error;
+    if (!std::filesystem::is_regular_file(cache_path, error) || !clone_file(cache_path, to_path(output_path))) {
+        stats.cache_misses += 1;
+        return false;
+    }
+
+    // Modification time orders entries by last use, eviction reads it back.
+    std::filesystem::last_write_time(cache_path, std::filesystem::file_time_type::clock::now(), error);
+
+    stats.cache_hits += 1;
+    add_time(Phase::write, timer);
+    return true;
+}
+
+// Stores the finished output file under `key`, then evicts least recently used entries down to 90% of
+// `cache_max_bytes` if the cache outgrew it, so eviction doesn't run after every store.
+void store_cached(CacheKey key, Span<utf8> output_path) {
+    auto timer = create_precise_timer();
+    defer { add_time(Phase::write, timer); };
+
+    std::lock_guard lock(cache_index.mutex);
+    load_cache_index();
+
+    auto cache_path = get_cache_path(key);
+    if (!clone_file(to_path(output_path), cache_path))
+        return;
+
+    std::error_code error;
+
+    // The same output stored again, by this process or another one, replaces its entry.
+    auto size = std::filesystem::file_size(cache_path, error);
+    auto now = std::filesystem::file_time_type::clock::now();
+    auto found = std::find_if(cache_index.entries.begin(), cache_index.entries.end(), [&](auto &entry) { return entry.path == cache_path; });
+    if (found != cache_index.entries.end()) {
+        cache_index.total_size -= found->size;
+        *found = {cache_path, now, size};
+    } else {
+        cache_index.entries.push_back({cache_path, now, size});
+    }
+    cache_index.total_size += size;
+
+    if (cache_index.total_size <= cache_max_bytes)
+        return;
+
+    // Hits in this or other processes only touched the files.
+    for (auto &entry : cache_index.entries) {
+        auto used = std::filesystem::last_write_time(entry.path, error);
+        if (!error)
+            entry.used = used;
+    }
+    std::sort(cache_index.entries.begin(), cache_index.entries.end(), [](auto &a, auto &b) { return a.used < b.used; });
+
+    umm evicted = 0;
+    while (evicted < cache_index.entries.size() && cache_index.total_size > cache_max_bytes / 10 * 9) {
+        auto &entry = cache_index.entries[evicted++];
+        std::filesystem::remove(entry.path, error);
+        cache_index.total_size -= entry.size;
+    }
+    cache_index.entries.erase(cache_index.entries.begin(), cache_index.entries.begin() + evicted);
+}
+
+// Bounded multi-producer multi-consumer queue between batch stages.
+template <class T>
+struct BatchQueue {
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<T> items;
+    umm capacity = 4;
+    s32 producer_count = 0;
+};
+
+template <class T>
+void push(BatchQueue<T> &queue, T item) {
+    std::unique_lock lock(queue.mutex);
+    queue.not_full.wait(lock, [&] { return queue.items.size() < queue.capacity; });
+    queue.items.push_back(item);
+    queue.not_empty.notify_one();
+}
+
+// Returns false when the queue is empty and all producers are done.
+template <class T>
+bool pop(BatchQueue<T> &queue, T *item) {
+    std::unique_lock lock(queue.mutex);
+    queue.not_empty.wait(lock, [&] { return queue.items.size() || queue.producer_count == 0; });
+    if (queue.items.empty())
+        return false;
+    *item = queue.items.front();
+    queue.items.pop_front();
+    queue.not_full.notify_one();
+    return true;
+}
+
+template <class T>
+void finish_producing(BatchQueue<T> &queue) {
+    std::lock_guard lock(queue.mutex);
+    if (--queue.producer_count == 0)
+        queue.not_empty.notify_all();
+}
+
+bool matches_wildcard(std::u8string_view pattern, std::u8string_view name) {
+    if (pattern.empty())
+        return name.empty();
+    if (pattern[0] == u8'*') {
+        for (umm i = 0; i <= name.size(); ++i) {
+            if (matches_wildcard(pattern.substr(1), name.substr(i)))
+                return true;
+        }
+        return false;
+    }
+    if (name.empty())
+        return false;
+    if (pattern[0] != u8'?' && pattern[0] != name[0])
+        return false;
+    return matches_wildcard(pattern.substr(1), name.substr(1));
+}
+
+// Expands a directory, a wildcard in the last path component, or a list file into input paths.
+bool collect_batch_inputs(Span<utf8> list, std::vector<std::filesystem::path> &inputs) {
+    std::u8string list_string((char8_t *)list.data, list.count);
+    std::filesystem::path list_path = list_string;
+    std::error_code error;
+
+    if (std::filesystem::is_directory(list_path, error)) {
+        for (auto &entry : std::filesystem::directory_iterator(list_path, error)) {
+            if (entry.is_regular_file())
+                inputs.push_back(entry.path());
+        }
+    } else if (list_string.find_first_of(u8"*?") != std::u8string::npos) {
+        auto directory = list_path.parent_path();
+        auto pattern = list_path.filename().u8string();
+        for (auto &entry : std::filesystem::directory_iterator(directory.empty() ? "." : directory, error)) {
+            if (entry.is_regular_file() && matches_wildcard(pattern, entry.path().filename().u8string()))
+                inputs.push_back(entry.path());
+        }
+    } else {
+        auto buffer = read_entire_file(list);
+        if (!buffer.data) {
+            with(ConsoleColor::red, print("Error: "));
+            print("Failed to read '{}'\n", list);
+            return false;
+        }
+        defer { free(buffer); };
+
+        umm line_start = 0;
+        for (umm i = 0; i <= buffer.count; ++i) {
+            if (i == buffer.count || buffer.data[i] == '\n') {
+                umm line_end = i;
+                while (line_end > line_start && (buffer.data[line_end - 1] == '\r' || buffer.data[line_end - 1] == ' '))
+                    --line_end;
+                if (line_end > line_start)
+                    inputs.push_back(std::u8string((char8_t *)buffer.data + line_start, line_end - line_start));
+                line_start = i + 1;
+            }
+        }
+    }
+
+    if (error) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Failed to list '{}'\n", list);
+        return false;
+    }
+
+    std::sort(inputs.begin(), inputs.end());
+    return true;
+}
+
+struct BatchItem {
+    umm index = 0;
+    Image image = {};
+    bool cacheable = false;
+    CacheKey cache_key = {};
+};
+
+// Runs `pipeline` over every input. Reading and decoding, filtering and encoding run concurrently
+// and are connected with bounded queues, so file and codec work overlaps with filtering.
+// Filters still use the thread pool, so decoding and encoding get a few dedicated threads each.
+s32 run_batch(Span<utf8> list, Span<utf8> output_directory, Pipeline &pipeline) {
+    std::vector<std::filesystem::path> inputs;
+    if (!collect_batch_inputs(list, inputs)) {
+        return 4;
+    }
+
+    bool in_place = output_directory == u8"-i"s;
+    std::filesystem::path output_directory_path = std::u8string((char8_t *)output_directory.data, output_directory.count);
+    if (!in_place) {
+        std::error_code error;
+        std::filesystem::create_directories(output_directory_path, error);
+    }
+
+    auto get_output_path = [&](umm index) {
+        if (in_place)
+            return inputs[index];
+        auto extension = get_extension(output_format_set ? output_format : ImageFormat{ImageFormat::png});
+        return output_directory_path / inputs[index].filename().replace_extension(std::u8string((char8_t *)extension.data, extension.count));
+    };
+
+    print("Processing {} images\n", inputs.size());
+
+    s32 const decoder_count = 2;
+    s32 const encoder_count = 2;
+
+    BatchQueue<BatchItem> decoded;
+    BatchQueue<BatchItem> filtered;
+    decoded.producer_count = decoder_count;
+    filtered.producer_count = 1;
+
+    std::atomic<umm> next_input = 0;
+    std::atomic<s32> failed_count = 0;
+
+    auto allocator = current_allocator;
+
+    std::vector<std::thread> threads;
+    for (s32 i = 0; i < decoder_count; ++i) {
+        threads.emplace_back([&] {
+            current_allocator = allocator;
+            for (umm index; (index = next_input++) < inputs.size();) {
+                auto path = inputs[index].u8string();
+                Span<utf8> input_path = {(utf8 *)path.data(), path.size()};
+
+                BatchItem item = {.index = index, .image = {}, .cacheable = false, .cache_key = {}};
+                if (cache_directory.count) {
+                    auto output_path = get_output_path(index).u8string();
+                    Span<utf8> output_span = {(utf8 *)output_path.data(), output_path.size()};
+                    item.cacheable = get_cache_key(pipeline, input_path, output_span, &item.cache_key);
+                    if (item.cacheable && fetch_cached(item.cache_key, output_span)) {
+                        count_cached_image(pipeline, input_path);
+                        continue;
+                    }
+                }
+
+                if (load_image(input_path, item.image)) {
+                    ++failed_count;
+                    continue;
+                }
+
+                push(decoded, item);
+            }
+            finish_producing(decoded);
+        });
+    }
+
+    for (s32 i = 0; i < encoder_count; ++i) {
+        threads.emplace_back([&] {
+            current_allocator = allocator;
+
+            // The pool is busy with filters, encode on this thread only.
+            inside_parallel_for = true;
+
+            BatchItem item;
+            while (pop(filtered, &item)) {
+                auto path = get_output_path(item.index).u8string();
+                Span<utf8> output_path = {(utf8 *)path.data(), path.size()};
+                if (save_image(output_path, item.image.pixels, item.image.size))
+                    ++failed_count;
+                else if (item.cacheable)
+                    store_cached(item.cache_key, output_path);
+                free(item.image);
+            }
+        });
+    }
+
+    PipelineBuffers buffers;
+    defer { free(buffers); };
+
+    BatchItem item;
+    while (pop(decoded, &item)) {
+        Pixel *result_pixels;
+        v2s result_size;
+        bool ok = apply_pipeline(pipeline, item.image.pixels, item.image.size, buffers, &result_pixels, &result_size);
+        auto input_size = item.image.size;
+        free(item.image);
+
+        if (!ok) {
+            ++failed_count;
+            continue;
+        }
+
+        count_image(input_size, result_size);
+
+        // Hand the result buffer over to the encoder, next image gets a new one.
+        for (s32 i = 0; i < 2; ++i) {
+            if (buffers.pixels[i] == result_pixels) {
+                buffers.pixels[i] = 0;
+                buffers.capacities[i] = 0;
+            }
+        }
+
+        push(filtered, BatchItem{
+            .index = item.index,
+            .image = {.pixels = result_pixels, .size = result_size, .from_stb = false, .in_place = false, .mapping = {}},
+            .cacheable = item.cacheable,
+            .cache_key = item.cache_key,
+        });
+    }
+    finish_producing(filtered);
+
+    for (auto &thread : threads)
+        thread.join();
+
+    print("Processed {} images, {} failed\n", inputs.size() - failed_count, (s32)failed_count);
+    return failed_count ? 8 : 0;
+}
+
+// Sums the halos of all stages. Returns false if some stage needs the whole image, changes the size,
+// or stages disagree on what happens at the top and bottom edges.
+bool get_pipeline_halo(Pipeline &pipeline, Halo *result) {
+    Halo total = {0, true};
+    for (umm i = 0; i < pipeline.stages.count; ++i) {
+        auto &stage = pipeline.stages[i];
+        auto halo = stage.filter.get_halo(stage.state);
+        auto size = stage.filter.get_destination_size({1, 1}, stage.state);
+        if (halo.rows < 0 || size.x != 1 || size.y != 1) {
+            print("'{}' with these options needs the whole image\n", stage.filter.name);
+            return false;
+        }
+        if (i != 0 && halo.wraps != total.wraps) {
+            print("'{}' handles image edges differently from previous filters\n", stage.filter.name);
+            return false;
+        }
+        total.rows += halo.rows;
+        total.wraps = halo.wraps;
+    }
+    *result = total;
+    return true;
+}
+
+// Runs `pipeline` on horizontal strips of `strip_rows` rows, each read together with `halo.rows`
+// rows above and below it (wrapped around or cut at the edges, as the filters do).
+// Output is always encoded strip by strip. Netpbm input is streamed too, so then peak memory is
+// about width * (strip_rows + 2*halo). Other inputs are decoded as a whole.
+s32 run_strips(Pipeline &pipeline, Halo halo, s32 strip_rows, Span<utf8> input_path, Span<utf8> output_path) {
+    NetpbmFile input_file;
+    defer { free(input_file); };
+
+    Image input_image;
+    defer { free(input_image); };
+
+    v2s size;
+    if (open_netpbm(input_path, input_file)) {
+        size = input_file.size;
+    } else {
+        if (auto error = load_image(input_path, input_image))
+            return error;
+        size = input_image.size;
+    }
+
+    auto read_rows = [&](s32 y, s32 count, Pixel *pixels) {
+        if (input_image.pixels) {
+            memcpy(pixels, input_image.pixels + (umm)y*size.x, sizeof(Pixel)*size.x*count);
+            return true;
+        }
+        return read_netpbm_rows(input_file, y, count, pixels);
+    };
+
+    // Rows are written as soon as a strip is done. Writing in place goes through a temporary file,
+    // because the last strips still read rows from the top of the input.
+    auto output_file_path = to_path(output_path);
+    std::error_code error;
+    bool in_place = std::filesystem::equivalent(to_path(input_path), output_file_path, error);
+    if (in_place)
+        output_file_path += u8".tmp";
+    auto output_file_string = output_file_path.u8string();
+
+    ImageWriter writer;
+    defer { free(writer); };
+
+    if (!begin_image(writer, {(utf8 *)output_file_string.data(), output_file_string.size()}, size, get_output_format(output_path))) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Failed to write '{}'\n", output_path);
+        return 7;
+    }
+
+    strip_rows = clamp(strip_rows, 1, size.y);
+
+    auto strip_pixels = current_allocator.allocate<Pixel>((umm)size.x*(strip_rows + halo.rows*2));
+    defer { current_allocator.free(strip_pixels); };
+
+    PipelineBuffers buffers;
+    defer { free(buffers); };
+
+    s32 strip_count = (size.y + strip_rows - 1) / strip_rows;
+    for (s32 strip = 0; strip < strip_count; ++strip) {
+        verbose_print("Strip {}/{}\n", strip + 1, strip_count);
+
+        s32 begin = strip*strip_rows;
+        s32 end = min(begin + strip_rows, size.y);
+
+        s32 top = begin - halo.rows;
+        s32 bottom = end + halo.rows;
+        if (!halo.wraps) {
+            top = max(top, 0);
+            bottom = min(bottom, size.y);
+        }
+
+        for (s32 row = top; row < bottom;) {
+            s32 y = frac(row, size.y);
+            s32 count = min(bottom - row, size.y - y);
+            if (!read_rows(y, count, strip_pixels + (umm)(row - top)*size.x)) {
+                with(ConsoleColor::red, print("Error: "));
+                print("Failed to read '{}'\n", input_path);
+                return 4;
+            }
+            row += count;
+        }
+
+        Pixel *result_pixels;
+        v2s result_size;
+        if (!apply_pipeline(pipeline, strip_pixels, {size.x, bottom - top}, buffers, &result_pixels, &result_size)) {
+            return 6;
+        }
+
+        if (!write_rows(writer, result_pixels + (umm)(begin - top)*size.x, end - begin)) {
+            with(ConsoleColor::red, print("Error: "));
+            print("Failed to write '{}'\n", output_path);
+            return 7;
+        }
+    }
+
+    if (!end_image(writer)) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Failed to write '{}'\n", output_path);
+        return 7;
+    }
+
+    if (in_place) {
+        free(input_file);
+        std::filesystem::rename(output_file_path, to_path(output_path), error);
+        if (error) {
+            with(ConsoleColor::red, print("Error: "));
+            print("Failed to write '{}'\n", output_path);
+            return 7;
+        }
+    }
+
+    count_image(size, size);
+    return 0;
+}
+
+s32 run_image(Pipeline &pipeline, Span<utf8> input_path, Span<utf8> output_path, PipelineBuffers &buffers) {
+    Image source;
+    defer { free(source); };
+
+    if (auto error = load_image(input_path, source)) {
+        return error;
+    }
+
+    Pixel *destination_pixels;
+    v2s destination_size;
+    if (!apply_pipeline(pipeline, source.pixels, source.size, buffers, &destination_pixels, &destination_size)) {
+        return 6;
+    }
+
+    auto source_size = source.size;
+
+    // The input may be mapped, release it before writing in place.
+    free(source);
+
+    if (auto error = save_image(output_path, destination_pixels, destination_size)) {
+        return error;
+    }
+
+    count_image(source_size, destination_size);
+    return 0;
+}
+
+s32 run_image(Pipeline &pipeline, Span<utf8> input_path, Span<utf8> output_path) {
+    PipelineBuffers buffers;
+    defer { free(buffers); };
+
+    return run_image(pipeline, input_path, output_path, buffers);
+}
+
+// Peak resident memory of the process in bytes, 0 if unknown.
+u64 get_peak_memory() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize;
+#else
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        return usage.ru_maxrss;
+#else
+        return (u64)usage.ru_maxrss*1024;
+#endif
+    }
+#endif
+    return 0;
+}
+
+// Where `--stats -` writes, see `reserve_stdout_for_stats`.
+static FILE *stats_stdout = stdout;
+
+// Keeps stdout for the JSON record of `--stats -`: option echo and progress are turned off, and everything else
+// printed from now on goes to stderr, so the record can be parsed without filtering.
+void reserve_stdout_for_stats() {
+    verbose = false;
+#ifndef _WIN32
+    fflush(stdout);
+    s32 stats_fd = dup(STDOUT_FILENO);
+    if (stats_fd == -1)
+        return;
+    if (auto file = fdopen(stats_fd, "w")) {
+        stats_stdout = file;
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    } else {
+        close(stats_fd);
+    }
+#endif
+}
+
+// Writes one JSON record describing the run, for job schedulers. Path "-" writes to stdout.
+bool write_stats(Span<utf8> path, s32 status, f64 total_seconds) {
+    bool to_stdout = path == u8"-"s;
+    auto file = to_stdout ? stats_stdout : fopen(to_path(path).string().c_str(), "wb");
+    if (!file)
+        return false;
+
+    auto simd = kernels.level.names[(umm)kernels.level.value];
+    fprintf(file, "{\n  \"status\": %d,\n  \"threads\": %d,\n  \"simd\": \"%.*s\",\n", status, thread_pool.thread_count, (int)simd.count, (char *)simd.data);
+    fprintf(file, "  \"images\": %llu,\n  \"input_pixels\": %llu,\n  \"output_pixels\": %llu,\n",
+        (unsigned long long)stats.images, (unsigned long long)stats.input_pixels, (unsigned long long)stats.output_pixels);
+    fprintf(file, "  \"cache_hits\": %llu,\n  \"cache_misses\": %llu,\n", (unsigned long long)stats.cache_hits, (unsigned long long)stats.cache_misses);
+    fprintf(file, "  \"peak_memory_bytes\": %llu,\n", (unsigned long long)get_peak_memory());
+    fprintf(file, "  \"seconds\": {\n    \"total\": %.6f", total_seconds);
+    for (umm i = 0; i < (umm)Phase::count; ++i)
+        fprintf(file, ",\n    \"%s\": %.6f", phase_names[i], (f64)stats.seconds[i]);
+    fprintf(file, "\n  }\n}\n");
+
+    if (to_stdout)
+        return fflush(file) == 0;
+    return fclose(file) == 0;
+}
+
+// Daemon mode. `--serve <socket>` keeps filters, the thread pool, kernels and pixel buffers alive and runs jobs
+// sent over a Unix socket one at a time, `--connect <socket>` is the matching client.
+// A job is one line of space separated arguments, replies are one line too:
+//   file <input> <output> <pipeline>            -> ok <output>
+//   pixels <width>x<height> <pipeline>          -> ok <width>x<height>
+//   shutdown                                    -> ok
+// `pixels` is followed by width*height RGBA pixels and its reply by the resulting pixels.
+// Failed jobs reply `error <status>` with the status the command line would return.
+// Connections that send or take nothing for this long are dropped, so a stalled client can't block other jobs.
+s32 serve_timeout_seconds = 30;
+
+// Largest `pixels` job, so a client can't make the daemon allocate arbitrary memory.
+s32 serve_max_megapixels = 64;
+
+#ifndef _WIN32
+
+struct SocketReader {
+    int socket = -1;
+    u8 buffer[16*1024];
+    umm begin = 0;
+    umm end = 0;
+};
+
+bool fill(SocketReader &reader) {
+    ssize_t received;
+    do {
+        received = recv(reader.socket, reader.buffer, sizeof(reader.buffer), 0);
+    } while (received < 0 && errno == EINTR);
+    if (received <= 0)
+        return false;
+
+    reader.begin = 0;
+    reader.end = (umm)received;
+    return true;
+}
+
+// Reads up to the next newline, which is not included. Lines longer than `max_count` fail.
+bool read_line(SocketReader &reader, List<utf8> &line, umm max_count = 64*1024) {
+    line.count = 0;
+    while (true) {
+        if (reader.begin == reader.end && !fill(reader))
+            return false;
+
+        while (reader.begin < reader.end) {
+            auto c = reader.buffer[reader.begin++];
+            if (c == '\n')
+                return true;
+            if (c != '\r')
+                line.add(c);
+        }
+        if (line.count > max_count)
+            return false;
+    }
+}
+
+bool read_exact(SocketReader &reader, void *data, umm count) {
+    auto bytes = (u8 *)data;
+    while (count) {
+        if (reader.begin == reader.end && !fill(reader))
+            return false;
+
+        umm chunk = min(count, reader.end - reader.begin);
+        memcpy(bytes, reader.buffer + reader.begin, chunk);
+        reader.begin += chunk;
+        bytes += chunk;
+        count -= chunk;
+    }
+    return true;
+}
+
+bool send_all(int socket, void const *data, umm count) {
+    auto bytes = (u8 const *)data;
+    while (count) {
+        ssize_t sent = send(socket, bytes, count, 0);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        bytes += sent;
+        count -= (umm)sent;
+    }
+    return true;
+}
+
+template <class ...Args>
+bool send_reply(int socket, char const *format, Args ...args) {
+    char reply[1024];
+    int count = snprintf(reply, sizeof(reply), format, args...);
+    return count > 0 && (umm)count < sizeof(reply) && send_all(socket, reply, (umm)count);
+}
+
+// Points `args` into `line`, which is split at spaces in place.
+void split_arguments(List<utf8> &line, List<Span<utf8>> &args) {
+    args.count = 0;
+    umm start = 0;
+    for (umm i = 0; i <= line.count; ++i) {
+        if (i == line.count || line.data[i] == ' ') {
+            if (i > start)
+                args.add({line.data + start, i - start});
+            start = i + 1;
+        }
+    }
+}
+
+bool open_socket(Span<utf8> path, sockaddr_un *address) {
+    *address = {};
+    address->sun_family = AF_UNIX;
+    if (path.count >= sizeof(address->sun_path)) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Socket path '{}' is too long\n", path);
+        return false;
+    }
+    memcpy(address->sun_path, path.data, path.count);
+    return true;
+}
+
+s32 serve(Span<utf8> socket_path) {
+    // A client that hangs up early must not kill the daemon.
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address;
+    if (!open_socket(socket_path, &address))
+        return 1;
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Failed to create a socket\n");
+        return 1;
+    }
+    defer { close(listener); };
+
+    // A socket file left by a daemon that exited without cleaning up blocks bind. Anything else at the path,
+    // or the socket of a daemon that is still running, is left alone.
+    struct stat info;
+    if (lstat(address.sun_path, &info) == 0) {
+        if (!S_ISSOCK(info.st_mode)) {
+            with(ConsoleColor::red, print("Error: "));
+            print("'{}' exists and is not a socket\n", socket_path);
+            return 1;
+        }
+
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool owned = probe >= 0 && connect(probe, (sockaddr *)&address, sizeof(address)) == 0;
+        if (probe >= 0)
+            close(probe);
+        if (owned) {
+            with(ConsoleColor::red, print("Error: "));
+            print("Another daemon is serving on '{}'\n", socket_path);
+            return 1;
+        }
+
+        unlink(address.sun_path);
+    }
+
+    // Jobs read and write files with the daemon's permissions, so only its user may connect. The mode is set
+    // before listen, no connection can be made before that.
+    if (bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || chmod(address.sun_path, 0600) != 0 || listen(listener, 16) != 0) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Failed to listen on '{}'\n", socket_path);
+        return 1;
+    }
+    defer { unlink(address.sun_path); };
+
+    print("Serving on '{}'\n", socket_path);
+
+    // Kept across jobs, so repeated jobs of similar size don't allocate pixels.
+    PipelineBuffers buffers;
+    defer { free(buffers); };
+
+    Pixel *input_pixels = 0;
+    umm input_capacity = 0;
+    defer {
+        if (input_pixels)
+            current_allocator.free(input_pixels);
+    };
+
+    auto reader = new SocketReader;
+    defer { delete reader; };
+
+    List<utf8> line;
+    defer { free(line); };
+
+    List<Span<utf8>> args;
+    defer { free(args); };
+
+    bool running = true;
+    while (running) {
+        int connection = accept(listener, 0, 0);
+        if (connection < 0) {
+            if (errno == EINTR)
+                continue;
+            with(ConsoleColor::red, print("Error: "));
+            print("Failed to accept a connection\n");
+            return 1;
+        }
+        defer { close(connection); };
+
+        // Idle connections time out in recv and send, which then fail and drop the connection.
+        timeval timeout = {.tv_sec = serve_timeout_seconds, .tv_usec = 0};
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        reader->socket = connection;
+        reader->begin = reader->end = 0;
+
+        while (running && read_line(*reader, line)) {
+            split_arguments(line, args);
+            if (!args.count)
+                continue;
+
+            Pipeline pipeline;
+            defer { free(pipeline); };
+
+            auto job = args[0];
+            if (job == u8"shutdown"s) {
+                running = false;
+                send_reply(connection, "ok\n");
+            } else if (job == u8"file"s && args.count >= 4) {
+                auto input_path = args[1];
+                auto output_path = args[2];
+                if (output_path == u8"-i"s)
+                    output_path = input_path;
+
+                s32 status = parse_pipeline(args.skip(3), pipeline);
+                if (status == 0)
+                    status = run_with_cache(pipeline, input_path, output_path, [&] { return run_image(pipeline, input_path, output_path, buffers); });
+
+                bool sent = status == 0
+                    ? send_reply(connection, "ok %.*s\n", (int)output_path.count, (char *)output_path.data)
+                    : send_reply(connection, "error %d\n", status);
+                if (!sent)
+                    break;
+            } else if (job == u8"pixels"s && args.count >= 3) {
+                v2s size;
+                if (!parse_option(job, args[1], &size) || size.x <= 0 || size.y <= 0 || (u64)size.x*size.y > ((u64)serve_max_megapixels << 20)) {
+                    // The pixels can't be skipped without their size, drop the connection.
+                    send_reply(connection, "error 1\n");
+                    break;
+                }
+
+                umm pixel_count = (umm)size.x*size.y;
+                if (input_capacity < pixel_count) {
+                    if (input_pixels)
+                        current_allocator.free(input_pixels);
+                    input_pixels = current_allocator.allocate<Pixel>(pixel_count, 64);
+                    input_capacity = pixel_count;
+                }
+
+                // `args` point into `line`, which stays untouched until the next job.
+                auto timer = create_precise_timer();
+                bool received = read_exact(*reader, input_pixels, pixel_count*sizeof(Pixel));
+                add_time(Phase::read, timer);
+                if (!received)
+                    break;
+
+                s32 status = parse_pipeline(args.skip(2), pipeline);
+
+                Pixel *result_pixels;
+                v2s result_size;
+                if (status == 0 && !apply_pipeline(pipeline, input_pixels, size, buffers, &result_pixels, &result_size))
+                    status = 6;
+
+                if (status) {
+                    if (!send_reply(connection, "error %d\n", status))
+                        break;
+                    continue;
+                }
+
+                reset(timer);
+                bool sent = send_reply(connection, "ok %dx%d\n", result_size.x, result_size.y)
+                         && send_all(connection, result_pixels, (umm)result_size.x*result_size.y*sizeof(Pixel));
+                add_time(Phase::write, timer);
+                if (!sent)
+                    break;
+
+                count_image(size, result_size);
+            } else {
+                with(ConsoleColor::red, print("Error: "));
+                print("Unknown job '{}'\n", job);
+                if (!send_reply(connection, "error 1\n"))
+                    break;
+            }
+        }
+    }
+    return 0;
+}
+
+// Sends one job to a daemon. `args` are <input> <output> <pipeline> like on the command line.
+// With `send_pixels` the client decodes and encodes the images itself, otherwise the daemon reads and writes the files.
+s32 run_client(Span<utf8> socket_path, Span<Span<utf8>> args, bool send_pixels) {
+    for (auto arg : args) {
+        for (auto c : arg) {
+            if (c == ' ' || c == '\n') {
+                with(ConsoleColor::red, print("Error: "));
+                print("Arguments sent to a daemon can't contain spaces or newlines: '{}'\n", arg);
+                return 1;
+            }
+        }
+    }
+
+    sockaddr_un address;
+    if (!open_socket(socket_path, &address))
+        return 1;
+
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0 || connect(connection, (sockaddr *)&address, sizeof(address)) != 0) {
+        if (connection >= 0)
+            close(connection);
+        with(ConsoleColor::red, print("Error: "));
+        print("Failed to connect to '{}'\n", socket_path);
+        return 1;
+    }
+    defer { close(connection); };
+
+    auto input_path = args[0];
+    auto output_path = args[1];
+    if (output_path == u8"-i"s)
+        output_path = input_path;
+
+    List<utf8> request;
+    defer { free(request); };
+
+    auto append = [&](Span<utf8> text) {
+        for (auto c : text)
+            request.add(c);
+    };
+
+    Image source;
+    defer { free(source); };
+
+    // The daemon may run in another directory, send absolute paths.
+    std::u8string absolute_input, absolute_output;
+    if (send_pixels) {
+        if (auto error = load_image(input_path, source))
+            return error;
+
+        char size[64];
+        snprintf(size, sizeof(size), "pixels %dx%d", source.size.x, source.size.y);
+        append({(utf8 *)size, strlen(size)});
+    } else {
+        absolute_input = std::filesystem::absolute(to_path(input_path)).u8string();
+        absolute_output = std::filesystem::absolute(to_path(output_path)).u8string();
+        append(u8"file "s);
+        append({(utf8 *)absolute_input.data(), absolute_input.size()});
+        append(u8" "s);
+        append({(utf8 *)absolute_output.data(), absolute_output.size()});
+    }
+    for (auto arg : args.skip(2)) {
+        append(u8" "s);
+        append(arg);
+    }
+    append(u8"\n"s);
+
+    auto fail = [&] {
+        with(ConsoleColor::red, print("Error: "));
+        print("Lost connection to '{}'\n", socket_path);
+        return 1;
+    };
+
+    if (!send_all(connection, request.data, request.count))
+        return fail();
+    if (send_pixels && !send_all(connection, source.pixels, (umm)source.size.x*source.size.y*sizeof(Pixel)))
+        return fail();
+
+    auto reader = new SocketReader;
+    defer { delete reader; };
+    reader->socket = connection;
+
+    List<utf8> reply;
+    defer { free(reply); };
+
+    if (!read_line(*reader, reply))
+        return fail();
+
+    Span<utf8> reply_span = reply;
+    if (reply_span.count > 6 && Span<utf8>{reply_span.data, 6} == u8"error "s) {
+        auto status = parse_u64(reply_span.skip(6));
+        with(ConsoleColor::red, print("Error: "));
+        print("Daemon failed the job with status {}\n", reply_span.skip(6));
+        return status ? (s32)status.value_unchecked() : 1;
+    }
+    if (reply_span.count < 3 || !(Span<utf8>{reply_span.data, 3} == u8"ok "s))
+        return fail();
+
+    if (!send_pixels) {
+        verbose_print("Wrote '{}'\n", reply_span.skip(3));
+        return 0;
+    }
+
+    v2s size;
+    if (!parse_option(u8"reply"s, reply_span.skip(3), &size))
+        return fail();
+
+    auto pixels = current_allocator.allocate<Pixel>((umm)size.x*size.y, 64);
+    defer { current_allocator.free(pixels); };
+    if (!read_exact(*reader, pixels, (umm)size.x*size.y*sizeof(Pixel)))
+        return fail();
+
+    // The input may be mapped, release it before writing in place.
+    free(source);
+
+    return save_image(output_path, pixels, size);
+}
+
+#else
+
+s32 serve(Span<utf8> socket_path) {
+    with(ConsoleColor::red, print("Error: "));
+    print("--serve is not supported on Windows\n");
+    return 1;
+}
+
+s32 run_client(Span<utf8> socket_path, Span<Span<utf8>> args, bool send_pixels) {
+    with(ConsoleColor::red, print("Error: "));
+    print("--connect is not supported on Windows\n");
+    return 1;
+}
+
+#endif
+
+bool save_tuning(Span<utf8> path, Tuning const &values) {
+    auto file = fopen(to_path(path).string().c_str(), "wb");
+    if (!file)
+        return false;
+
+    fprintf(file, "# Written by --calibrate, read with --algo auto\n");
+    #define _SAVE_TUNING(type, member, default) fprintf(file, "%s %d\n", #member, values.member);
+    ENUMERATE_TUNING(_SAVE_TUNING)
+    #undef _SAVE_TUNING
+    return fclose(file) == 0;
+}
+
+// Times the variants `tuning` chooses between on a noise image, prints the results and saves the crossovers.
+// Takes a few seconds with the current thread pool and kernels.
+s32 calibrate(Span<utf8> tuning_path) {
+    bool was_verbose = verbose;
+    auto forced_tile_size = tile_size;
+    verbose = false;
+    tile_size = {};
+    defer {
+        verbose = was_verbose;
+        tile_size = forced_tile_size;
+    };
+
+    v2s const max_size = {512, 512};
+    umm pixel_count = (umm)max_size.x*max_size.y;
+    auto source = current_allocator.allocate<Pixel>(pixel_count, 64);
+    auto destination = current_allocator.allocate<Pixel>(pixel_count, 64);
+    defer {
+        current_allocator.free(source);
+        current_allocator.free(destination);
+    };
+
+    u32 random = 1;
+    for (umm i = 0; i < pixel_count; ++i) {
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        memcpy(&source[i], &random, sizeof(Pixel));
+    }
+
+    auto state = current_allocator.allocate<u8>(filter_state_size);
+    defer { current_allocator.free(state); };
+
+    FilterCache cache;
+    defer { free(cache); };
+
+    // Fastest of a few runs of `filter_name` with `radius` on `size` pixels, in seconds.
+    auto time_filter = [&](Span<utf8> filter_name, s32 radius, v2s size) {
+        auto filter = find_if(filters, [&](auto filter) { return filter.name == filter_name; });
+
+        char radius_string[16];
+        snprintf(radius_string, sizeof(radius_string), "%d", radius);
+        Span<utf8> options[] = {u8"radius"s, {(utf8 *)radius_string, strlen(radius_string)}};
+        filter->parse({options, count_of(options)}, state);
+
+        f64 fastest = 1e30;
+        for (s32 run = 0; run < 3; ++run) {
+            auto timer = create_precise_timer();
+            filter->apply(source, size, destination, size, cache, state);
+            fastest = min(fastest, get_time(timer));
+        }
+        return fastest;
+    };
+
+    // Largest radius up to which the specialized variant keeps winning.
+    auto find_max_radius = [&](Span<utf8> filter_name, s32 &max_radius, char const *specialized_name, char const *generic_name) {
+        s32 result = 0;
+        for (s32 radius = 1; radius <= 5; ++radius) {
+            max_radius = radius;
+            f64 specialized = time_filter(filter_name, radius, max_size);
+            max_radius = 0;
+            f64 generic = time_filter(filter_name, radius, max_size);
+            print("{} radius {}: {} {} ms, {} {} ms\n", filter_name, radius, specialized_name, specialized*1000, generic_name, generic*1000);
+            if (specialized > generic)
+                break;
+            result = radius;
+        }
+        max_radius = result;
+    };
+
+    Tuning defaults = tuning;
+    defer { tuning = defaults; };
+
+    tuning = {};
+    find_max_radius(u8"median"s, tuning.median_specialized_max_radius, "specialized", "generic");
+    find_max_radius(u8"bilateral"s, tuning.bilateral_specialized_max_radius, "specialized", "generic");
+    find_max_radius(u8"kuwahara"s, tuning.kuwahara_direct_max_radius, "direct", "table");
+
+    // Rows against tiles on images of equal area with growing width. Rows are kept up to the largest window
+    // before tiles first win.
+    s32 const tile_radius = 8;
+    s32 tile_window_bytes = 0;
+    for (s32 width : {256, 1024, 4096, 16384}) {
+        v2s size = {min(width, (s32)pixel_count), max((s32)(pixel_count / 4 / width), 1)};
+        s32 window_bytes = (tile_radius*2 + 1)*(size.x + tile_radius*2)*(s32)sizeof(Pixel);
+
+        tuning.tile_window_bytes = 0x7fffffff;
+        f64 rows = time_filter(u8"bilateral"s, tile_radius, size);
+        tuning.tile_window_bytes = 0;
+        f64 tiles = time_filter(u8"bilateral"s, tile_radius, size);
+        print("bilateral {}x{} radius {}: rows {} ms, tiles {} ms\n", size.x, size.y, tile_radius, rows*1000, tiles*1000);
+        if (tiles < rows)
+            break;
+        tile_window_bytes = window_bytes;
+    }
+    tuning.tile_window_bytes = tile_window_bytes;
+
+    auto measured = tuning;
+    #define _PRINT_TUNING(type, member, default) print("{} {}\n", u8###member##s, measured.member);
+    ENUMERATE_TUNING(_PRINT_TUNING)
+    #undef _PRINT_TUNING
+
+    if (!save_tuning(tuning_path, measured)) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Failed to write '{}'\n", tuning_path);
+        return 7;
+    }
+    return 0;
+}
+
+// Fills `filters`, must be called before anything looks filters up.
+void register_filters() {
+    construct(filters);
+
+    {
+        #define ENUMERATE_OPTIONS(e) \
+            e(s32, radius, 0) \
+            e(s32, threshold, 128) \
+            e(DistanceMethod, distance, {}) \
+            e(bool, smooth, true) \
+            e(DilateMethod, method, {DilateMethod::nearest}) \
+
+        DEFINE_OPTIONS;
+
+        filters.add({
+            .name = u8"dilate"s,
+            .hash = Options::hash,
+            .parse = [](Span<Span<utf8>> selected_options, void *_state) -> bool {
+                DEFINE_STATE;
+                state = {};
+
+                PARSE_OPTIONS;
+
+                return true;
+            },
+            .get_destination_size = [](v2s source_size, void *) -> v2s {
+                return source_size;
+            },
+            .get_halo = [](void *_state) -> Halo {
+                DEFINE_STATE;
+                if (state.radius <= 0 || state.method.value == DilateMethod::pushpull)
+                    return {-1, false};
+                return {state.radius, false};
+            },
+            .apply = [](Pixel *source_pixels, v2s source_size, Pixel *destination_pixels, v2s, FilterCache &cache, void *_state) -> bool {
+                DEFINE_STATE;
+
+
+                auto radius = state.radius ? state.radius : max(source_size);
+                auto threshold = state.threshold;
+                auto distance = state.distance;
+                auto smooth = state.smooth;
+                auto method = state.method;
+
+                verbose_print("radius: {}\n", radius);
+                verbose_print("threshold: {}\n", threshold);
+                verbose_print("method: {}\n", method);
+
+                if (method.value == DilateMethod::pushpull) {
+                    dilate_push_pull(source_pixels, destination_pixels, source_size, radius, [&](Pixel p){ return p.w < threshold; });
+                    return true;
+                }
+
+                verbose_print("distance: {}\n", distance);
+                verbose_print("smooth: {}\n", smooth);
+
+                switch (distance.value) {
+                    case DistanceMethod::euclidean: dilate<EuclideanMetric>(source_pixels, destination_pixels, source_size, (f32)radius, smooth, cache, [&](Pixel p){ return p.w < threshold; }, [&](auto b){ return length(b); }); break;
+                    case DistanceMethod::chebyshev: dilate<ChebyshevMetric>(source_pixels, destination_pixels, source_size, (f32)radius, smooth, cache, [&](Pixel p){ return p.w < threshold; }, [&](auto b){ return max(absolute(b)); }); break;
+                    case DistanceMethod::manhattan: dilate<ManhattanMetric>(source_pixels, destination_pixels, source_size, (f32)radius, smooth, cache, [&](Pixel p){ return p.w < threshold; }, [&](auto b){ return sum(absolute(b)); }); break;
+                }
+
+                return true;
+            },
+        });
+
+        #undef ENUMERATE_OPTIONS
+    }
+
+    {
+        #define ENUMERATE_OPTIONS(e) \
+            e(s32, radius, 8) \
+            e(s32, percent, 50) \
+            e(Border, border, {Border::wrap}) \
+
+        DEFINE_OPTIONS;
+
+        filters.add({
+            .name = u8"median"s,
+            .hash = Options::hash,
+            .parse = [](Span<Span<utf8>> selected_options, void *_state) -> bool {
+                DEFINE_STATE;
+                state = {};
+
+                PARSE_OPTIONS;
+
+                return true;
+            },
+            .get_destination_size = [](v2s source_size, void *) -> v2s {
+                return source_size;
+            },
+            .get_halo = [](void *_state) -> Halo {
+                DEFINE_STATE;
+                return {max(state.radius, 0), state.border.value == Border::wrap};
+            },
+            .apply = [](Pixel *source_pixels, v2s source_size, Pixel *destination_pixels, v2s destination_size, FilterCache &, void *_state) -> bool {
+                DEFINE_STATE;
+
+
+                auto radius = max(state.radius, 0);
+                auto percent = clamp(state.percent, 0, 100);
+                auto border = state.border;
+
+                verbose_print("radius: {}\n", radius);
+                verbose_print("percent: {}\n", percent);
+                verbose_print("border: {}\n", border);
+
+                // Sliding window histogram of luma (Huang). The circular window is stored as one ring buffer
+                // per window row, so moving one pixel to the right replaces the leftmost sample of every row
+                // with a new one on the right: O(radius) per pixel, not the O(1) of per-column histograms,
+                // which only fit square windows. Ranks are searched in a two-level 16x16 histogram, at most
+                // 32 bins per pixel. Every bin keeps a list of the samples in it to be able to return an
+                // original pixel.
+
+                auto row_half_widths = current_allocator.allocate<s32>(radius*2 + 1);
+                auto row_slot_offsets = current_allocator.allocate<s32>(radius*2 + 1);
+                defer {
+                    current_allocator.free(row_half_widths);
+                    current_allocator.free(row_slot_offsets);
+                };
+
+                s32 window_area = 0;
+                for (s32 oy = -radius; oy <= +radius; ++oy) {
+                    s32 half_width = get_circle_half_width(radius, oy);
+                    row_half_widths[oy + radius] = half_width;
+                    row_slot_offsets[oy + radius] = window_area;
+                    window_area += half_width*2 + 1;
+                }
+
+                // Samples index the padded image, so window rows never wrap.
+                auto padded = pad_image(source_pixels, source_size, radius, border);
+                defer { free(padded); };
+
+                auto lumas = current_allocator.allocate<u8>((umm)padded.size.x*padded.size.y);
+                defer { current_allocator.free(lumas); };
+
+                parallel_for(padded.size.y, [&](s32 y, s32) {
+                    for (s32 i = y*padded.size.x; i < (y + 1)*padded.size.x; ++i) {
+                        lumas[i] = (u8)clamp((s32)dot((v3f)padded.pixels[i].xyz, v3f{0.299f, 0.587f, 0.114f}), 0, 255);
+                    }
+                });
+
+                struct Sample {
+                    s32 source_index;
+                    s32 prev;
+                    s32 next;
+                };
+
+                // Per-thread window state, rows are independent.
+                struct Window {
+                    Sample *samples;
+                    s32 fine_counts[256];
+                    s32 coarse_counts[16];
+                    s32 bin_heads[256];
+                };
+
+                auto windows = current_allocator.allocate<Window>(thread_pool.thread_count);
+                auto all_samples = current_allocator.allocate<Sample>(window_area*thread_pool.thread_count);
+                defer {
+                    current_allocator.free(windows);
+                    current_allocator.free(all_samples);
+                };
+                for (s32 i = 0; i < thread_pool.thread_count; ++i) {
+                    windows[i].samples = all_samples + window_area*i;
+                }
+
+                auto add = [&](Window &window, s32 slot, s32 source_index) {
+                    auto bin = lumas[source_index];
+                    auto &sample = window.samples[slot];
+                    sample.source_index = source_index;
+                    sample.prev = -1;
+                    sample.next = window.bin_heads[bin];
+                    if (sample.next != -1)
+                        window.samples[sample.next].prev = slot;
+                    window.bin_heads[bin] = slot;
+                    window.fine_counts[bin] += 1;
+                    window.coarse_counts[bin / 16] += 1;
+                };
+                auto remove = [&](Window &window, s32 slot) {
+                    auto &sample = window.samples[slot];
+                    auto bin = lumas[sample.source_index];
+                    if (sample.prev != -1) window.samples[sample.prev].next = sample.next;
+                    else                   window.bin_heads[bin] = sample.next;
+                    if (sample.next != -1) window.samples[sample.next].prev = sample.prev;
+                    window.fine_counts[bin] -= 1;
+                    window.coarse_counts[bin / 16] -= 1;
+                };
+
+                s32 rank = min(window_area * percent / 100, window_area - 1);
+
+                // Offset of the padded row under each window row, per thread.
+                auto all_row_offsets = current_allocator.allocate<s32>((radius*2 + 1)*thread_pool.thread_count);
+                defer { current_allocator.free(all_row_offsets); };
+
+                dispatch_small_radius(radius, tuning.median_specialized_max_radius, [&]<s32 static_radius>() {
+                    // Calls `fn(row, half_width, first_slot)` for every window row.
+                    auto for_each_row = [&](auto &&fn) {
+                        if constexpr (static_radius) {
+                            using Window = CircleWindow<static_radius>;
+                            for (s32 row = 0; row < Window::row_count; ++row)
+                                fn(row, Window::half_widths[row], Window::row_starts[row]);
+                        } else {
+                            for (s32 row = 0; row < radius*2 + 1; ++row)
+                                fn(row, row_half_widths[row], row_slot_offsets[row]);
+                        }
+                    };
+
+                    parallel_for(source_size.y, [&](s32 py, s32 thread_index) {
+                        if (thread_index == 0)
+                            report_progress(py, source_size.y);
+
+                        auto &window = windows[thread_index];
+                        auto row_offsets = all_row_offsets + (radius*2 + 1)*thread_index;
+
+                        memset(window.fine_counts, 0, sizeof(window.fine_counts));
+                        memset(window.coarse_counts, 0, sizeof(window.coarse_counts));
+                        memset(window.bin_heads, -1, sizeof(window.bin_heads));
+
+                        for_each_row([&](s32 row, s32 half_width, s32 first_slot) {
+                            row_offsets[row] = (py + row)*padded.size.x + radius;
+                            for (s32 ox = -half_width; ox <= +half_width; ++ox) {
+                                add(window, first_slot + frac(ox, half_width*2 + 1), row_offsets[row] + ox);
+                            }
+                        });
+
+                        for (s32 px = 0; px < source_size.x; ++px) {
+                            s32 coarse = 0;
+                            s32 below = 0;
+                            while (below + window.coarse_counts[coarse] <= rank) {
+                                below += window.coarse_counts[coarse];
+                                ++coarse;
+                            }
+                            s32 bin = coarse*16;
+                            while (below + window.fine_counts[bin] <= rank) {
+                                below += window.fine_counts[bin];
+                                ++bin;
+                            }
+
+                            destination_pixels[py*destination_size.x + px] = padded.pixels[window.samples[window.bin_heads[bin]].source_index];
+
+                            if (px + 1 == source_size.x)
+                                break;
+
+                            for_each_row([&](s32 row, s32 half_width, s32 first_slot) {
+                                s32 slot = first_slot + frac(px - half_width, half_width*2 + 1);
+                                remove(window, slot);
+                                add(window, slot, row_offsets[row] + px + 1 + half_width);
+                            });
+                        }
+                    });
+                });
+
+                return true;
+            },
+        });
+
+        #undef ENUMERATE_OPTIONS
+    }
+
+    {
+        #define ENUMERATE_OPTIONS(e) \
+            e(s32, radius, 8) \
+            e(f32, scale, 1) \
+            e(BilateralMode, mode, {BilateralMode::exact}) \
+            e(Border, border, {Border::wrap}) \
+            e(f32, sigma_s, 0) \
+            e(f32, sigma_r, 30) \
+
+        DEFINE_OPTIONS;
+
+        filters.add({
+            .name = u8"bilateral"s,
+            .hash = Options::hash,
+            .parse = [](Span<Span<utf8>> selected_options, void *_state) -> bool {
+                DEFINE_STATE;
+                state = {};
+
+                PARSE_OPTIONS;
+
+                return true;
+            },
+            .get_destination_size = [](v2s source_size, void *) -> v2s {
+                return source_size;
+            },
+            .get_halo = [](void *_state) -> Halo {
+                DEFINE_STATE;
+                if (state.mode.value == BilateralMode::grid)
+                    return {-1, false};
+                return {max(state.radius, 0), state.border.value == Border::wrap};
+            },
+            .apply = [](Pixel *source_pixels, v2s source_size, Pixel *destination_pixels, v2s destination_size, FilterCache &, void *_state) -> bool {
+                DEFINE_STATE;
+
+
+                auto radius = max(state.radius, 0);
+                auto scale = clamp(state.scale, 0.f, 10.f);
+                auto mode = state.mode;
+                auto border = state.border;
+
+                verbose_print("radius: {}\n", radius);
+                verbose_print("scale: {}\n", scale);
+                verbose_print("mode: {}\n", mode);
+                verbose_print("border: {}\n", border);
+
+                if (mode.value == BilateralMode::gaussian) {
+                    // By default the window ends at two standard deviations.
+                    auto sigma_s = state.sigma_s > 0 ? state.sigma_s : max(radius * 0.5f, 0.5f);
+                    auto sigma_r = max(state.sigma_r, 0.5f);
+
+                    verbose_print("sigma_s: {}\n", sigma_s);
+                    verbose_print("sigma_r: {}\n", sigma_r);
+
+                    auto padded = pad_image(source_pixels, source_size, radius, border);
+                    defer { free(padded); };
+
+                    bilateral_gaussian(padded, source_size, destination_pixels, destination_size, radius, sigma_s, sigma_r);
+                    return true;
+                }
+
+                if (mode.value == BilateralMode::grid) {
+                    // Blurred grid cells reach about two cells away, so spatial extent matches `radius` and
+                    // range extent matches the luma difference at which the exact weight drops to zero.
+                    auto spatial_cell = max(radius * 0.5f, 1.f);
+                    auto range_cell = max(255.f / max(scale, 0.5f) * 0.5f, 1.f);
+                    bilateral_grid(source_pixels, destination_pixels, source_size, spatial_cell, range_cell);
+                    return true;
+                }
+
+                auto row_half_widths = current_allocator.allocate<s32>(radius*2 + 1);
+                defer { current_allocator.free(row_half_widths); };
+
+                for (s32 oy = -radius; oy <= +radius; ++oy) {
+                    row_half_widths[oy + radius] = get_circle_half_width(radius, oy);
+                }
+
+                auto padded = pad_image(source_pixels, source_size, radius, border);
+                defer { free(padded); };
+
+                // Every output reads `radius` rows above and below, tiles keep them cached for wide images.
+                dispatch_small_radius(radius, tuning.bilateral_specialized_max_radius, [&]<s32 static_radius>() {
+                for_each_tile(source_size, get_tile_size(source_size, radius, sizeof(Pixel)), [&](v2s tile_min, v2s tile_max, s32) {
+                for (s32 py = tile_min.y; py < tile_max.y; ++py)
+                for (s32 px = tile_min.x; px < tile_max.x; ++px) {
+                    v4f c = (v4f)source_pixels[py*source_size.x + px];
+
+                    v4f sum = {};
+                    f32 den = 0;
+
+                    // Small windows have constant row widths. Rows of radius 1 are too short for the vector
+                    // kernels, its five samples are weighted inline instead.
+                    if constexpr (static_radius == 1) {
+                        for (auto offset : CircleWindow<1>::offsets) {
+                            auto p = (v4f)*get_pixel(padded, px + offset.x, py + offset.y);
+                            auto w = get_bilateral_weight(c, p, scale);
+                            sum += p * w;
+                            den += w;
+                        }
+                    } else if constexpr (static_radius) {
+                        using Window = CircleWindow<static_radius>;
+                        for (s32 row = 0; row < Window::row_count; ++row) {
+                            s32 half_width = Window::half_widths[row];
+                            auto pixels = get_pixel(padded, px - half_width, py + row - static_radius);
+                            kernels.bilateral_short(pixels, half_width*2 + 1, c, scale, &sum, &den);
+                        }
+                    } else {
+                        for (s32 oy = -radius; oy <= +radius; ++oy) {
+                            s32 half_width = row_half_widths[oy + radius];
+                            kernels.bilateral(get_pixel(padded, px - half_width, py + oy), half_width*2 + 1, c, scale, &sum, &den);
+                        }
+                    }
+
+                    destination_pixels[py*destination_size.x + px] = (Pixel)(sum / den);
+                }
+                });
+                });
+
+                return true;
+            },
+        });
+
+        #undef ENUMERATE_OPTIONS
+    }
+
+    {
+        #define ENUMERATE_OPTIONS(e) \
+            e(s32, radius, 8) \
+            e(Border, border, {Border::wrap}) \
+
+        DEFINE_OPTIONS;
+
+        filters.add({
+            .name = u8"kuwahara"s,
+            .hash = Options::hash,
+            .parse = [](Span<Span<utf8>> selected_options, void *_state) -> bool {
+                DEFINE_STATE;
+                state = {};
+
+                PARSE_OPTIONS;
+
+                // Summed-area tables are exact only up to this radius, see apply.
+                if (state.radius > 255) {
+                    with(ConsoleColor::red, print("Error: "));
+                    print("Kuwahara radius must be at most 255, but got {}\n", state.radius);
+                    return false;
+                }
+
+                return true;
+            },
+            .get_destination_size = [](v2s source_size, void *) -> v2s {
+                return source_size;
+            },
+            .get_halo = [](void *_state) -> Halo {
+                DEFINE_STATE;
+                return {max(state.radius, 0), state.border.value == Border::wrap};
+            },
+            .apply = [](Pixel *source_pixels, v2s source_size, Pixel *destination_pixels, v2s destination_size, FilterCache &, void *_state) -> bool {
+                DEFINE_STATE;
+
+
+                auto radius = state.radius;
+                auto border = state.border;
+
+                verbose_print("radius: {}\n", radius);
+                verbose_print("border: {}\n", border);
+
+                // Quadrant sums and sums of squares are taken from summed-area tables of the source,
+                // padded by `radius` on each side according to `border`.
+                // Tables are u32 and rely on unsigned wrap-around, which is exact as long as the
+                // sum of squares of a single quadrant fits, so parse rejects radii above 255.
+                radius = max(radius, 0);
+
+                bool done = false;
+                dispatch_small_radius(radius, tuning.kuwahara_direct_max_radius, [&]<s32 static_radius>() {
+                    if constexpr (static_radius) {
+                        kuwahara_small<static_radius>(source_pixels, source_size, destination_pixels, destination_size, border);
+                        done = true;
+                    }
+                });
+                if (done)
+                    return true;
+
+                auto padded = pad_image(source_pixels, source_size, radius, border);
+                defer { free(padded); };
+
+                auto quadrant_width = radius+1;
+                auto quadrant_area = (u32)pow2(quadrant_width);
+
+                v2s table_size = padded.size + 1;
+
+                auto sums    = current_allocator.allocate<v4u32>(table_size.x*table_size.y);
+                auto squares = current_allocator.allocate<v4u32>(table_size.x*table_size.y);
+                defer {
+                    current_allocator.free(sums);
+                    current_allocator.free(squares);
+                };
+
+                // Prefix sums along rows first, then accumulate rows down each column.
+                for (s32 tx = 0; tx < table_size.x; ++tx) {
+                    sums[tx] = {};
+                    squares[tx] = {};
+                }
+                parallel_for(table_size.y - 1, [&](s32 row, s32) {
+                    s32 ty = row + 1;
+
+                    v4u32 row_sum = {};
+                    v4u32 row_square = {};
+
+                    sums[ty*table_size.x] = {};
+                    squares[ty*table_size.x] = {};
+
+                    kernels.row_sums(padded.pixels + row*padded.size.x, padded.size.x, &row_sum, &row_square, sums + ty*table_size.x + 1, squares + ty*table_size.x + 1);
+                });
+                parallel_for(table_size.x, [&](s32 tx, s32) {
+                    for (s32 ty = 1; ty < table_size.y; ++ty) {
+                        sums   [ty*table_size.x + tx] += sums   [(ty-1)*table_size.x + tx];
+                        squares[ty*table_size.x + tx] += squares[(ty-1)*table_size.x + tx];
+                    }
+                });
+
+                auto quadrant_sum = [&](v4u32 *table, s32 tx, s32 ty) {
+                    return table[(ty + quadrant_width)*table_size.x + tx + quadrant_width]
+                         - table[(ty                 )*table_size.x + tx + quadrant_width]
+                         - table[(ty + quadrant_width)*table_size.x + tx                 ]
+                         + table[(ty                 )*table_size.x + tx                 ];
+                };
+
+                v2s quadrant_offsets[4] = {
+                    { -radius, -radius},
+                    {       0, -radius},
+                    { -radius,       0},
+                    {       0,       0},
+                };
+
+                parallel_for(source_size.y, [&](s32 py, s32 thread_index) {
+                if (thread_index == 0)
+                    report_progress(py, source_size.y);
+                for (s32 px = 0; px < source_size.x; ++px) {
+                    v4u32 min_sum = {};
+                    s64 min_variance = 0;
+
+                    for (s32 i = 0; i < 4; ++i) {
+                        s32 tx = px + quadrant_offsets[i].x + radius;
+                        s32 ty = py + quadrant_offsets[i].y + radius;
+
+                        auto sum    = quadrant_sum(sums,    tx, ty);
+                        auto square = quadrant_sum(squares, tx, ty);
+
+                        // Sum of per-channel variances, scaled by area squared.
+                        s64 variance =
+                            (s64)quadrant_area*((s64)square.x + square.y + square.z + square.w)
+                            - ((s64)sum.x*sum.x + (s64)sum.y*sum.y + (s64)sum.z*sum.z + (s64)sum.w*sum.w);
+
+                        if (i == 0 || variance < min_variance) {
+                            min_variance = variance;
+                            min_sum = sum;
+                        }
+                    }
+
+                    destination_pixels[py*destination_size.x + px] = (Pixel)(min_sum / quadrant_area);
+                }
+                });
+
+                return true;
+            },
+        });
+
+        #undef ENUMERATE_OPTIONS
+    }
+
+    {
+        #define ENUMERATE_OPTIONS(e) \
+            e(s32, slices, 36) \
+            e(Blend, blend, {Blend::average}) \
+            e(Sampling, sampling, {Sampling::nearest}) \
+
+        DEFINE_OPTIONS;
+
+        filters.add({
+            .name = u8"skidmark"s,
+            .hash = Options::hash,
+            .parse = [](Span<Span<utf8>> selected_options, void *_state) -> bool {
+                DEFINE_STATE;
+                state = {};
+
+                PARSE_OPTIONS;
+
+                return true;
+            },
+            .get_destination_size = [](v2s source_size, void *_state) -> v2s {
+                DEFINE_STATE;
+                return {source_size.x, state.slices};
+            },
+            .get_halo = [](void *) -> Halo {
+                return {-1, false};
+            },
+            .apply = [](Pixel *source_pixels, v2s source_size, Pixel *destination_pixels, v2s, FilterCache &, void *_state) -> bool {
+                DEFINE_STATE;
+
+                verbose_print("slices: {}\n", state.slices);
+                verbose_print("blend: {}\n", state.blend);
+                verbose_print("sampling: {}\n", state.sampling);
+
+                project_slices(source_pixels, source_size, destination_pixels, state.slices, state.blend.value == Blend::average, state.sampling.value == Sampling::bilinear);
+
+                return true;
+            },
+        });
+
+        #undef ENUMERATE_OPTIONS
+    }
+    // Min and max filters share their options.
+    {
+        #define ENUMERATE_OPTIONS(e) \
+            e(s32, radius, 1) \
+            e(WindowShape, shape, {WindowShape::square}) \
+            e(MorphologyChannel, channel, {MorphologyChannel::alpha}) \
+            e(Border, border, {Border::clamp}) \
+
+        DEFINE_OPTIONS;
+
+        auto parse = [](Span<Span<utf8>> selected_options, void *_state) -> bool {
+            DEFINE_STATE;
+            state = {};
+
+            PARSE_OPTIONS;
+
+            return true;
+        };
+        auto get_halo = [](void *_state) -> Halo {
+            DEFINE_STATE;
+            return {max(state.radius, 0), state.border.value == Border::wrap};
+        };
+        static auto print_options = [](Options &state) {
+            verbose_print("radius: {}\n", state.radius);
+            verbose_print("shape: {}\n", state.shape);
+            verbose_print("channel: {}\n", state.channel);
+            verbose_print("border: {}\n", state.border);
+        };
+
+        filters.add({
+            .name = u8"erode"s,
+            .hash = Options::hash,
+            .parse = parse,
+            .get_destination_size = [](v2s source_size, void *) -> v2s {
+                return source_size;
+            },
+            .get_halo = get_halo,
+            .apply = [](Pixel *source_pixels, v2s source_size, Pixel *destination_pixels, v2s, FilterCache &, void *_state) -> bool {
+                DEFINE_STATE;
+                print_options(state);
+
+                morphology(source_pixels, source_size, destination_pixels, max(state.radius, 0), state.shape, state.border, state.channel, false,
+                    [](auto a, auto b) { return min(a, b); });
+                return true;
+            },
+        });
+
+        filters.add({
+            .name = u8"maxfilter"s,
+            .hash = Options::hash,
+            .parse = parse,
+            .get_destination_size = [](v2s source_size, void *) -> v2s {
+                return source_size;
+            },
+            .get_halo = get_halo,
+            .apply = [](Pixel *source_pixels, v2s source_size, Pixel *destination_pixels, v2s, FilterCache &, void *_state) -> bool {
+                DEFINE_STATE;
+                print_options(state);
+
+                morphology(source_pixels, source_size, destination_pixels, max(state.radius, 0), state.shape, state.border, state.channel, true,
+                    [](auto a, auto b) { return max(a, b); });
+                return true;
+            },
+        });
+
+        #undef ENUMERATE_OPTIONS
+    }
+}
@@ -0,0 +1,351 @@
+#pragma once
+
+// Filters, their building blocks and image i/o, implemented in filter.cpp. Programs that use them include this
+// header and compile filter.cpp once, the executable's own translation unit defines TL_IMPL, filter_api's is tl.cpp.
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <tl/math.h>
+#include <tl/console.h>
+#include <tl/file.h>
+#include <tl/time.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <atomic>
+#include <filesystem>
+#include <typeinfo>
+
+using namespace tl;
+
+using Pixel = v4u8;
+
+// Parameter echo and progress output of filters. The benchmark turns it off.
+extern bool verbose;
+
+template <class ...Args>
+inline void verbose_print(Args &&...args) {
+    if (verbose)
+        print(std::forward<Args>(args)...);
+}
+
+// Adds decoded and encoded pixels of one image to the --stats totals.
+void count_image(v2s input_size, v2s output_size);
+
+// Persistent pool of worker threads shared by all filters. `parallel_for` splits indices into one contiguous
+// range per thread, threads that run out of work steal the upper half of another thread's remaining range.
+struct ThreadPool {
+    struct alignas(64) Range {
+        std::mutex mutex;
+        s32 begin = 0;
+        s32 end = 0;
+    };
+
+    s32 thread_count = 1;
+    Range *ranges = 0;
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable job_started;
+    std::condition_variable job_finished;
+    void (*job)(void *fn, s32 index, s32 thread_index) = 0;
+    void *job_fn = 0;
+    u64 job_generation = 0;
+    s32 busy_worker_count = 0;
+    bool stopping = false;
+};
+
+extern ThreadPool thread_pool;
+extern thread_local bool inside_parallel_for;
+
+void init_thread_pool(ThreadPool &pool, s32 thread_count);
+void free(ThreadPool &pool);
+void run_job(ThreadPool &pool, s32 thread_index);
+
+// Calls `fn(index, thread_index)` for every index in [0, count) on the shared thread pool.
+// `thread_index` is in [0, thread_pool.thread_count) and can be used to pick per-thread scratch memory.
+// Nested calls run on the calling thread.
+template <class Fn>
+inline void parallel_for(s32 count, Fn &&fn) {
+    auto &pool = thread_pool;
+    if (pool.thread_count <= 1 || count <= 1 || inside_parallel_for) {
+        for (s32 i = 0; i < count; ++i)
+            fn(i, 0);
+        return;
+    }
+
+    for (s32 t = 0; t < pool.thread_count; ++t) {
+        pool.ranges[t].begin = (s32)((s64)count * t / pool.thread_count);
+        pool.ranges[t].end = (s32)((s64)count * (t + 1) / pool.thread_count);
+    }
+
+    {
+        std::lock_guard lock(pool.mutex);
+        pool.job = [](void *fn, s32 index, s32 thread_index) { (*(std::remove_reference_t<Fn> *)fn)(index, thread_index); };
+        pool.job_fn = (void *)&fn;
+        pool.busy_worker_count = pool.thread_count - 1;
+        ++pool.job_generation;
+    }
+    pool.job_started.notify_all();
+
+    run_job(pool, 0);
+
+    std::unique_lock lock(pool.mutex);
+    pool.job_finished.wait(lock, [&] { return pool.busy_worker_count == 0; });
+}
+
+// Tables that filters derive from their options and the image size. Whoever runs filters owns one and keeps it
+// between images, batches and strips usually run many images of the same size.
+struct FilterCache {
+    // Offsets within `dilate_radius` under `dilate_metric` that can land inside the image, sorted by length.
+    List<v2s16> dilate_offsets;
+    v2s dilate_extent = {};
+    s32 dilate_radius = -1;
+    std::type_info const *dilate_metric = 0;
+};
+
+void free(FilterCache &cache);
+
+// Rows above and below an output row that a filter reads, used to run it on strips.
+// Negative `rows` means the filter needs the whole image.
+struct Halo {
+    s32 rows;
+    bool wraps;
+};
+
+struct Hasher;
+
+struct Filter {
+    Span<utf8> name;
+    // Adds the parsed options to a result cache key one by one, padding between them is not hashed.
+    void (*hash)(Hasher &hasher, void *_state);
+    bool (*parse)(Span<Span<utf8>> options, void *_state);
+    v2s (*get_destination_size)(v2s source_size, void *_state);
+    Halo (*get_halo)(void *_state);
+    bool (*apply)(Pixel *source_pixels, v2s source_size, Pixel *destination_pixels, v2s destination_size, FilterCache &cache, void *_state);
+};
+
+bool parse_option(Span<utf8> name, Span<utf8> value, bool *result);
+bool parse_option(Span<utf8> name, Span<utf8> value, s32 *result);
+bool parse_option(Span<utf8> name, Span<utf8> value, f32 *result);
+// Parses "<width>x<height>".
+bool parse_option(Span<utf8> name, Span<utf8> value, v2s *result);
+bool parse_option(Span<utf8> name, Span<utf8> value, Span<utf8> *result);
+
+template <class T>
+bool parse_option(Span<utf8> name, Span<utf8> value, T *result)
+    requires requires { T::is_usable_enum == true; }
+{
+    for (umm i = 0; i < count_of(T::names); ++i) {
+        if (value == T::names[i]) {
+            result->value = (decltype(result->value)) i;
+            return true;
+        }
+    }
+    with(ConsoleColor::red, print("Error: "));
+    print("Expected one of following values after '{}', but got '{}'n", name, value);
+    for (auto name : T::names) {
+        print("  {}\n", name);
+    }
+    return false;
+}
+
+#define _DEFINE_ENUM_VALUE(name) name,
+#define _DEFINE_ENUM_NAME(name) u8###name##s,
+
+#define DEFINE_ENUM(enum_name) \
+    struct enum_name { \
+        inline static constexpr bool is_usable_enum = true; \
+        enum { \
+            ENUMERATE_ENUM(_DEFINE_ENUM_VALUE) \
+        } value; \
+        inline static constexpr Span<utf8> names[] { \
+            ENUMERATE_ENUM(_DEFINE_ENUM_NAME) \
+        }; \
+    }; \
+    inline umm append(StringBuilder &builder, enum_name e) { \
+        return append(builder, e.names[(umm)e.value]); \
+    }
+
+#define ENUMERATE_ENUM(e) \
+    e(png) \
+    e(qoi) \
+    e(raw) \
+    e(ppm) \
+    e(pam) \
+
+DEFINE_ENUM(ImageFormat);
+
+#undef ENUMERATE_ENUM
+
+#define ENUMERATE_ENUM(e) \
+    e(scalar) \
+    e(sse41) \
+    e(avx2) \
+    e(avx512) \
+
+DEFINE_ENUM(SimdLevel);
+
+#undef ENUMERATE_ENUM
+
+// Accumulates bilateral weights of `count` contiguous pixels against `center`.
+// Weight falls linearly from 1 to 0 as manhattan distance goes from 0 to 255*3/`scale`.
+using BilateralKernel = void (*)(Pixel const *pixels, s32 count, v4f center, f32 scale, v4f *sum, f32 *den);
+
+// Writes running sums and sums of squares of `count` contiguous pixels, starting from `row_sum` and `row_square`.
+using RowSumsKernel = void (*)(Pixel const *pixels, s32 count, v4u32 *row_sum, v4u32 *row_square, v4u32 *sums, v4u32 *squares);
+
+struct Kernels {
+    SimdLevel level = {SimdLevel::scalar};
+    BilateralKernel bilateral;
+    // For runs of at most 11 pixels, the rows of small windows. Wider vectors would only add calls.
+    BilateralKernel bilateral_short;
+    RowSumsKernel row_sums;
+};
+
+extern Kernels kernels;
+
+// Selects the widest kernels the CPU supports, up to `max_level`.
+void init_kernels(SimdLevel max_level);
+
+// Output tile size of bilateral, set by --tile. Zero picks a size from the cache size. Median slides its
+// histogram along rows and kuwahara reads summed-area tables, neither gains from tiles.
+extern v2s tile_size;
+
+bool load_tuning(Span<utf8> path);
+// Times variants of filters and writes the crossover points to `tuning_path`. Returns an exit code.
+s32 calibrate(Span<utf8> tuning_path);
+
+extern List<Filter> filters;
+
+// Fills `filters`, in the order of the command line usage.
+void register_filters();
+
+// Size of the options buffer every filter parses into.
+constexpr umm filter_state_size = 1024*1024;
+
+struct Stage {
+    Filter filter;
+    u8 *state;
+};
+
+// Filters applied one after another to in-memory images.
+struct Pipeline {
+    List<Stage> stages;
+};
+
+// Two buffers that pipeline stages write to in turn and the tables filters build. Kept between runs to avoid
+// reallocation and rebuilding.
+struct PipelineBuffers {
+    Pixel *pixels[2] = {};
+    umm capacities[2] = {};
+    FilterCache cache;
+};
+
+void free(Pipeline &pipeline);
+void free(PipelineBuffers &buffers);
+
+// Parses `<filter> [<filter options>] [-- <filter> [<filter options>]]...`.
+// Returns 0 on success, otherwise an exit code.
+s32 parse_pipeline(Span<Span<utf8>> args, Pipeline &pipeline);
+
+// Runs all stages, each one reading the previous stage's output.
+// On success `result` points into `buffers` and `result_size` is the size of the last stage's output.
+// With `final_destination` the last stage writes there instead, it must fit the output and not overlap the source.
+bool apply_pipeline(Pipeline &pipeline, Pixel *source_pixels, v2s source_size, PipelineBuffers &buffers, Pixel **result, v2s *result_size,
+                    Pixel *final_destination = 0);
+
+std::filesystem::path to_path(Span<utf8> path);
+
+// Encoder settings, from --output-format and --png-level. Without --output-format the output's extension decides.
+extern bool output_format_set;
+extern ImageFormat output_format;
+extern s32 png_level;
+
+// Size of headerless raw RGBA input, from --input-size.
+extern v2s raw_input_size;
+
+// Read-only view of a whole file. Pages are mapped copy-on-write, so writes never reach the file.
+struct MappedFile {
+    u8 *data = 0;
+    umm size = 0;
+#ifdef _WIN32
+    void *file = 0;
+    void *mapping = 0;
+#endif
+};
+
+// Whole decoded image. Inputs are mapped instead of read into a buffer. Headerless raw RGBA and
+// 4 channel pam are used in place, qoi and netpbm are decoded straight from the mapping,
+// everything else goes through stb_image.
+struct Image {
+    Pixel *pixels = 0;
+    v2s size = {};
+    bool from_stb = false;
+    bool in_place = false;
+    MappedFile mapping = {};
+};
+
+void free(MappedFile &mapped);
+void free(Image &image);
+
+// Load and save return 0 on success, otherwise an exit code, and print the error.
+s32 load_image(Span<utf8> path, Image &image);
+s32 save_image(Span<utf8> path, Pixel *pixels, v2s size);
+
+// Result cache, enabled by --cache. Disabled while `cache_directory` is empty.
+extern Span<utf8> cache_directory;
+extern u64 cache_max_bytes;
+
+struct CacheKey {
+    u64 a;
+    u64 b;
+};
+
+bool get_cache_key(Pipeline &pipeline, Span<utf8> input_path, Span<utf8> output_path, CacheKey *key);
+bool fetch_cached(CacheKey key, Span<utf8> output_path);
+void store_cached(CacheKey key, Span<utf8> output_path);
+
+// Counts an output copied from the cache in the --stats totals. Reads only the input's header, the output
+// size follows from the stages.
+void count_cached_image(Pipeline &pipeline, Span<utf8> input_path);
+
+// Runs `run()`, which writes `output_path`, unless the cache already has that output.
+template <class Run>
+inline s32 run_with_cache(Pipeline &pipeline, Span<utf8> input_path, Span<utf8> output_path, Run &&run) {
+    CacheKey key;
+    if (!cache_directory.count || !get_cache_key(pipeline, input_path, output_path, &key))
+        return run();
+
+    if (fetch_cached(key, output_path)) {
+        count_cached_image(pipeline, input_path);
+        verbose_print("Copied '{}' from the cache\n", output_path);
+        return 0;
+    }
+
+    s32 status = run();
+    if (status == 0)
+        store_cached(key, output_path);
+    return status;
+}
+
+// Ways to run a pipeline on files, each returns an exit code.
+s32 run_image(Pipeline &pipeline, Span<utf8> input_path, Span<utf8> output_path, PipelineBuffers &buffers);
+s32 run_image(Pipeline &pipeline, Span<utf8> input_path, Span<utf8> output_path);
+s32 run_batch(Span<utf8> list, Span<utf8> output_directory, Pipeline &pipeline);
+s32 run_strips(Pipeline &pipeline, Halo halo, s32 strip_rows, Span<utf8> input_path, Span<utf8> output_path);
+
+// Rows all stages together read around an output row. False if a stage needs the whole image.
+bool get_pipeline_halo(Pipeline &pipeline, Halo *result);
+
+void reserve_stdout_for_stats();
+bool write_stats(Span<utf8> path, s32 status, f64 total_seconds);
+
+// Daemon limits, from --serve-timeout and --serve-max-megapixels.
+extern s32 serve_timeout_seconds;
+extern s32 serve_max_megapixels;
+
+s32 serve(Span<utf8> socket_path);
+s32 run_client(Span<utf8> socket_path, Span<Span<utf8>> args, bool send_pixels);
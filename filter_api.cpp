@@ -0,0 +1,147 @@
+#include "filter_api.h"
+#include "filter.h"
+
+#include <string>
+
+struct FilterPipeline {
+    Pipeline pipeline;
+    PipelineBuffers buffers;
+
+    // Packed copy of a strided source. Strided destinations are copied from `buffers`.
+    Pixel *source_pixels = 0;
+    umm source_capacity = 0;
+};
+
+// Null-terminated copies of filter names.
+static std::vector<std::string> filter_names;
+
+int32_t filter_init(int32_t thread_count, char const *simd, bool verbose) {
+    init_printer();
+
+    ::verbose = verbose;
+
+    if (filter_names.empty()) {
+        register_filters();
+        for (auto &filter : filters)
+            filter_names.emplace_back((char *)filter.name.data, filter.name.count);
+    }
+
+    SimdLevel simd_level = {SimdLevel::avx512};
+    if (simd && !parse_option(u8"simd"s, Span<utf8>{(utf8 *)simd, strlen(simd)}, &simd_level))
+        return 1;
+
+    // Calling init again restarts the pool with the new thread count.
+    free(thread_pool);
+    init_thread_pool(thread_pool, thread_count > 0 ? thread_count : (s32)std::thread::hardware_concurrency());
+
+    init_kernels(simd_level);
+    return 0;
+}
+
+int32_t filter_load_tuning(char const *path) {
+    return load_tuning({(utf8 *)path, strlen(path)}) ? 0 : 1;
+}
+
+void filter_shutdown() {
+    free(thread_pool);
+}
+
+int32_t filter_get_count() {
+    return (int32_t)filter_names.size();
+}
+
+char const *filter_get_name(int32_t index) {
+    if (index < 0 || index >= (int32_t)filter_names.size())
+        return 0;
+    return filter_names[index].c_str();
+}
+
+int32_t filter_parse_pipeline(char const *const *args, int32_t arg_count, FilterPipeline **result) {
+    *result = 0;
+
+    List<Span<utf8>> spans;
+    defer { free(spans); };
+
+    for (s32 i = 0; i < arg_count; ++i)
+        spans.add({(utf8 *)args[i], strlen(args[i])});
+
+    auto pipeline = new FilterPipeline;
+    if (auto status = parse_pipeline(spans, pipeline->pipeline)) {
+        filter_free_pipeline(pipeline);
+        return status;
+    }
+
+    *result = pipeline;
+    return 0;
+}
+
+void filter_free_pipeline(FilterPipeline *pipeline) {
+    if (!pipeline)
+        return;
+
+    free(pipeline->pipeline);
+    free(pipeline->buffers);
+    if (pipeline->source_pixels)
+        current_allocator.free(pipeline->source_pixels);
+    delete pipeline;
+}
+
+void filter_get_destination_size(FilterPipeline *pipeline, int32_t width, int32_t height, int32_t *destination_width, int32_t *destination_height) {
+    v2s size = {width, height};
+    for (auto &stage : pipeline->pipeline.stages)
+        size = stage.filter.get_destination_size(size, stage.state);
+
+    *destination_width = size.x;
+    *destination_height = size.y;
+}
+
+int32_t filter_apply(FilterPipeline *pipeline, FilterBuffer source, FilterBuffer destination) {
+    v2s source_size = {source.width, source.height};
+    v2s destination_size;
+    filter_get_destination_size(pipeline, source.width, source.height, &destination_size.x, &destination_size.y);
+
+    if (source_size.x <= 0 || source_size.y <= 0 || destination.width != destination_size.x || destination.height != destination_size.y) {
+        with(ConsoleColor::red, print("Error: "));
+        print("Destination is {}x{}, but the pipeline makes {}x{} from {}x{}\n",
+            destination.width, destination.height, destination_size.x, destination_size.y, source_size.x, source_size.y);
+        return 1;
+    }
+
+    ptrdiff_t source_row_bytes = (ptrdiff_t)source_size.x*sizeof(Pixel);
+    ptrdiff_t destination_row_bytes = (ptrdiff_t)destination_size.x*sizeof(Pixel);
+    ptrdiff_t source_stride = source.stride ? source.stride : source_row_bytes;
+    ptrdiff_t destination_stride = destination.stride ? destination.stride : destination_row_bytes;
+
+    auto source_pixels = (Pixel *)source.pixels;
+    if (source_stride != source_row_bytes) {
+        umm pixel_count = (umm)source_size.x*source_size.y;
+        if (pipeline->source_capacity < pixel_count) {
+            if (pipeline->source_pixels)
+                current_allocator.free(pipeline->source_pixels);
+            pipeline->source_pixels = current_allocator.allocate<Pixel>(pixel_count, 64);
+            pipeline->source_capacity = pixel_count;
+        }
+        source_pixels = pipeline->source_pixels;
+        parallel_for(source_size.y, [&](s32 y, s32) {
+            memcpy(source_pixels + (umm)y*source_size.x, (u8 *)source.pixels + y*source_stride, source_row_bytes);
+        });
+    }
+
+    bool packed_destination = destination_stride == destination_row_bytes;
+
+    Pixel *result_pixels;
+    v2s result_size;
+    if (!apply_pipeline(pipeline->pipeline, source_pixels, source_size, pipeline->buffers, &result_pixels, &result_size,
+                        packed_destination ? (Pixel *)destination.pixels : 0)) {
+        return 6;
+    }
+
+    if (!packed_destination) {
+        parallel_for(result_size.y, [&](s32 y, s32) {
+            memcpy((u8 *)destination.pixels + y*destination_stride, result_pixels + (umm)y*result_size.x, destination_row_bytes);
+        });
+    }
+
+    count_image(source_size, result_size);
+    return 0;
+}
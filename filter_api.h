@@ -0,0 +1,68 @@
+#pragma once
+
+// Filters as a library, for programs that already hold decoded pixels in memory.
+// Link the filter_api target and include only this header, it does not depend on tl or stb.
+// The library carries tl's implementation unless built with FILTER_API_TL_IMPL=OFF, for hosts that compile tl
+// themselves. stb_image is internal to the library.
+// Pixels are RGBA with 8 bits per channel. Calls must not overlap, all pipelines share one thread pool.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The library is built with hidden visibility, this marks the functions it exports.
+#if defined(_WIN32)
+#define FILTER_API
+#else
+#define FILTER_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Caller-owned pixels. `stride` is the distance between the starts of two rows in bytes, 0 means packed rows.
+typedef struct FilterBuffer {
+    void *pixels;
+    int32_t width;
+    int32_t height;
+    ptrdiff_t stride;
+} FilterBuffer;
+
+typedef struct FilterPipeline FilterPipeline;
+
+// Registers filters, starts `thread_count` threads, 0 for one per core, and selects SIMD kernels up to
+// `simd`: "scalar", "sse41", "avx2" or "avx512", null for the widest the CPU supports.
+// `verbose` enables option echo and progress output on stdout. Returns 0 on success.
+FILTER_API int32_t filter_init(int32_t thread_count, char const *simd, bool verbose);
+
+// Picks variants of filters by the crossover points in a file written by `filter --calibrate`, like `--algo auto`.
+// Returns 0 on success.
+FILTER_API int32_t filter_load_tuning(char const *path);
+
+// Stops the thread pool. Pipelines must be freed before.
+FILTER_API void filter_shutdown(void);
+
+// Registered filters, in the order of the command line usage.
+FILTER_API int32_t filter_get_count(void);
+FILTER_API char const *filter_get_name(int32_t index);
+
+// Parses a pipeline written like on the command line, e.g. {"median", "radius", "3", "--", "erode"}.
+// Returns 0 and stores a pipeline to free with `filter_free_pipeline`, otherwise the status the command line
+// would exit with. Arguments are not referenced after this returns.
+FILTER_API int32_t filter_parse_pipeline(char const *const *args, int32_t arg_count, FilterPipeline **pipeline);
+
+FILTER_API void filter_free_pipeline(FilterPipeline *pipeline);
+
+// Size of the output of `pipeline` for a `width` x `height` source.
+FILTER_API void filter_get_destination_size(FilterPipeline *pipeline, int32_t width, int32_t height, int32_t *destination_width, int32_t *destination_height);
+
+// Runs `pipeline` from `source` into `destination`, which must have the size from `filter_get_destination_size`
+// and must not overlap `source`. Packed rows are read and written in place. Rows with padding are not: they are
+// copied on the thread pool into and out of buffers the pipeline keeps for its next calls, which costs one extra
+// pass over each strided image. Returns 0 on success.
+FILTER_API int32_t filter_apply(FilterPipeline *pipeline, FilterBuffer source, FilterBuffer destination);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,516 @@
+#define TL_IMPL
+#include "filter.h"
+
+#include <tl/main.h>
+
+#include <string>
+
+// Runs filters on small synthetic images and compares them against brute force references written for clarity,
+// not speed. Filters without a reference are run with every SIMD level, thread count and tile size, and must
+// match their scalar single threaded output. Encoded images must decode to the same pixels.
+// Exits with the number of failed checks.
+
+static s32 failure_count = 0;
+
+template <class ...Args>
+static void fail(Args &&...args) {
+    ++failure_count;
+    with(ConsoleColor::red, print("FAIL: "));
+    print(std::forward<Args>(args)...);
+    print("\n");
+}
+
+// Smooth gradients plus noise, with alpha holes so dilate has seeds and gaps.
+static std::vector<Pixel> generate_image(v2s size, u32 seed) {
+    u32 state = seed;
+    auto random = [&] {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    };
+
+    std::vector<Pixel> pixels((umm)size.x*size.y);
+    for (s32 y = 0; y < size.y; ++y) {
+        for (s32 x = 0; x < size.x; ++x) {
+            u32 noise = random();
+            pixels[y*size.x + x] = {
+                (u8)(x*255/size.x ^ (noise & 31)),
+                (u8)(y*255/size.y ^ (noise >> 8 & 31)),
+                (u8)(noise >> 16),
+                (u8)((noise >> 24) < 96 ? 255 : noise >> 26),
+            };
+        }
+    }
+    return pixels;
+}
+
+// Splits "median radius 3 -- erode" into arguments and applies the pipeline.
+static bool run_pipeline(char const *pipeline_string, std::vector<Pixel> &source, v2s size, std::vector<Pixel> &result, v2s *result_size) {
+    std::string text = pipeline_string;
+    List<Span<utf8>> args;
+    defer { free(args); };
+    for (umm begin = 0; begin < text.size();) {
+        auto end = text.find(' ', begin);
+        if (end == std::string::npos)
+            end = text.size();
+        args.add({(utf8 *)text.data() + begin, end - begin});
+        begin = end + 1;
+    }
+
+    Pipeline pipeline;
+    defer { free(pipeline); };
+    if (parse_pipeline(args, pipeline))
+        return false;
+
+    PipelineBuffers buffers;
+    defer { free(buffers); };
+
+    Pixel *pixels;
+    if (!apply_pipeline(pipeline, source.data(), size, buffers, &pixels, result_size))
+        return false;
+
+    result.assign(pixels, pixels + (umm)result_size->x*result_size->y);
+    return true;
+}
+
+static void set_threads(s32 thread_count) {
+    free(thread_pool);
+    init_thread_pool(thread_pool, thread_count);
+}
+
+// Same mapping of coordinates outside the image as the filters use, -1 reads a transparent pixel.
+static s32 reference_border(s32 x, s32 size, char const *border) {
+    if (x >= 0 && x < size)
+        return x;
+    if (!strcmp(border, "wrap"))
+        return (x % size + size) % size;
+    if (!strcmp(border, "clamp"))
+        return clamp(x, 0, size - 1);
+    if (!strcmp(border, "mirror")) {
+        if (size == 1)
+            return 0;
+        s32 period = (size - 1)*2;
+        x = (x % period + period) % period;
+        return x < size ? x : period - x;
+    }
+    return -1;
+}
+
+static Pixel reference_read(std::vector<Pixel> &source, v2s size, s32 x, s32 y, char const *border) {
+    x = reference_border(x, size.x, border);
+    y = reference_border(y, size.y, border);
+    return x < 0 || y < 0 ? Pixel{} : source[y*size.x + x];
+}
+
+static s32 reference_luma(Pixel p) {
+    return clamp((s32)dot((v3f)p.xyz, v3f{0.299f, 0.587f, 0.114f}), 0, 255);
+}
+
+static bool equal(Pixel a, Pixel b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z && a.w == b.w;
+}
+
+// Circular window: the output has the rank-th luma of the window and is one of the window's pixels.
+static void check_median(std::vector<Pixel> &source, v2s size, s32 radius, s32 percent, char const *border) {
+    char pipeline[128];
+    snprintf(pipeline, sizeof(pipeline), "median radius %d percent %d border %s", radius, percent, border);
+
+    std::vector<Pixel> result;
+    v2s result_size;
+    if (!run_pipeline(pipeline, source, size, result, &result_size)) {
+        fail("'{}' failed", pipeline);
+        return;
+    }
+
+    for (s32 y = 0; y < size.y; ++y) {
+        for (s32 x = 0; x < size.x; ++x) {
+            std::vector<Pixel> window;
+            for (s32 oy = -radius; oy <= radius; ++oy) {
+                s32 half_width = 0;
+                while ((half_width + 1)*(half_width + 1) + oy*oy <= radius*radius)
+                    ++half_width;
+                for (s32 ox = -half_width; ox <= half_width; ++ox)
+                    window.push_back(reference_read(source, size, x + ox, y + oy, border));
+            }
+
+            std::vector<s32> lumas;
+            for (auto p : window)
+                lumas.push_back(reference_luma(p));
+            std::sort(lumas.begin(), lumas.end());
+            s32 luma = lumas[min((s32)lumas.size()*percent/100, (s32)lumas.size() - 1)];
+
+            auto output = result[y*size.x + x];
+            bool found = false;
+            for (auto p : window)
+                found |= equal(p, output) && reference_luma(p) == luma;
+            if (!found) {
+                fail("'{}' at {}x{} is not a window pixel with luma {}", pipeline, x, y, luma);
+                return;
+            }
+        }
+    }
+}
+
+// Mean of the (radius+1)^2 quadrant with the lowest sum of channel variances, the first one on ties.
+static void check_kuwahara(std::vector<Pixel> &source, v2s size, s32 radius, char const *border) {
+    char pipeline[128];
+    snprintf(pipeline, sizeof(pipeline), "kuwahara radius %d border %s", radius, border);
+
+    std::vector<Pixel> result;
+    v2s result_size;
+    if (!run_pipeline(pipeline, source, size, result, &result_size)) {
+        fail("'{}' failed", pipeline);
+        return;
+    }
+
+    s64 area = (s64)(radius + 1)*(radius + 1);
+    v2s corners[4] = {{-radius, -radius}, {0, -radius}, {-radius, 0}, {0, 0}};
+    for (s32 y = 0; y < size.y; ++y) {
+        for (s32 x = 0; x < size.x; ++x) {
+            s64 best_variance = 0;
+            s64 best_sum[4] = {};
+            for (s32 i = 0; i < 4; ++i) {
+                s64 sum[4] = {};
+                s64 square = 0;
+                for (s32 qy = 0; qy <= radius; ++qy) {
+                    for (s32 qx = 0; qx <= radius; ++qx) {
+                        auto p = reference_read(source, size, x + corners[i].x + qx, y + corners[i].y + qy, border);
+                        for (s32 c = 0; c < 4; ++c) {
+                            sum[c] += p.s[c];
+                            square += p.s[c]*p.s[c];
+                        }
+                    }
+                }
+                s64 variance = area*square - (sum[0]*sum[0] + sum[1]*sum[1] + sum[2]*sum[2] + sum[3]*sum[3]);
+                if (i == 0 || variance < best_variance) {
+                    best_variance = variance;
+                    memcpy(best_sum, sum, sizeof(sum));
+                }
+            }
+
+            Pixel expected = {(u8)(best_sum[0]/area), (u8)(best_sum[1]/area), (u8)(best_sum[2]/area), (u8)(best_sum[3]/area)};
+            if (!equal(result[y*size.x + x], expected)) {
+                fail("'{}' at {}x{}", pipeline, x, y);
+                return;
+            }
+        }
+    }
+}
+
+// Minimum or maximum over the window. A disk is the octagon the filter builds from straight and diagonal passes.
+static void check_morphology(std::vector<Pixel> &source, v2s size, char const *filter, s32 radius, char const *shape, char const *channel, char const *border) {
+    char pipeline[128];
+    snprintf(pipeline, sizeof(pipeline), "%s radius %d shape %s channel %s border %s", filter, radius, shape, channel, border);
+
+    std::vector<Pixel> result;
+    v2s result_size;
+    if (!run_pipeline(pipeline, source, size, result, &result_size)) {
+        fail("'{}' failed", pipeline);
+        return;
+    }
+
+    bool maximum = !strcmp(filter, "maxfilter");
+    s32 diagonal = !strcmp(shape, "disk") ? (s32)(radius * (1 - 1/sqrtf(2))) : 0;
+    s32 straight = radius - diagonal*2;
+
+    std::vector<v2s> offsets;
+    for (s32 a = -straight; a <= straight; ++a)
+    for (s32 b = -straight; b <= straight; ++b)
+    for (s32 c = -diagonal; c <= diagonal; ++c)
+    for (s32 d = -diagonal; d <= diagonal; ++d)
+        offsets.push_back({a + c - d, b + c + d});
+
+    for (s32 y = 0; y < size.y; ++y) {
+        for (s32 x = 0; x < size.x; ++x) {
+            Pixel extreme = maximum ? Pixel{} : Pixel{255, 255, 255, 255};
+            for (auto offset : offsets) {
+                auto p = reference_read(source, size, x + offset.x, y + offset.y, border);
+                for (s32 c = 0; c < 4; ++c)
+                    extreme.s[c] = maximum ? max(extreme.s[c], p.s[c]) : min(extreme.s[c], p.s[c]);
+            }
+
+            auto expected = source[y*size.x + x];
+            if (!strcmp(channel, "alpha"))
+                expected.w = extreme.w;
+            else
+                expected = extreme;
+
+            if (!equal(result[y*size.x + x], expected)) {
+                fail("'{}' at {}x{}", pipeline, x, y);
+                return;
+            }
+        }
+    }
+}
+
+// Hard dilate: opaque pixels become fully opaque, others take the color of one of their nearest opaque pixels
+// within `radius` or stay as they are.
+static void check_dilate(std::vector<Pixel> &source, v2s size, s32 radius, char const *distance) {
+    char pipeline[128];
+    snprintf(pipeline, sizeof(pipeline), "dilate radius %d distance %s smooth false", radius, distance);
+
+    std::vector<Pixel> result;
+    v2s result_size;
+    if (!run_pipeline(pipeline, source, size, result, &result_size)) {
+        fail("'{}' failed", pipeline);
+        return;
+    }
+
+    // Squared for euclidean, so lengths compare exactly.
+    auto get_length = [&](s32 dx, s32 dy) -> s64 {
+        if (!strcmp(distance, "manhattan")) return abs(dx) + abs(dy);
+        if (!strcmp(distance, "chebyshev")) return max(abs(dx), abs(dy));
+        return (s64)dx*dx + (s64)dy*dy;
+    };
+    s64 max_length = !strcmp(distance, "euclidean") ? (s64)radius*radius : radius;
+
+    for (s32 y = 0; y < size.y; ++y) {
+        for (s32 x = 0; x < size.x; ++x) {
+            auto input = source[y*size.x + x];
+            auto output = result[y*size.x + x];
+
+            s64 nearest = -1;
+            for (s32 sy = 0; sy < size.y; ++sy) {
+                for (s32 sx = 0; sx < size.x; ++sx) {
+                    if (source[sy*size.x + sx].w < 128)
+                        continue;
+                    s64 length = get_length(sx - x, sy - y);
+                    if (nearest == -1 || length < nearest)
+                        nearest = length;
+                }
+            }
+
+            bool ok;
+            if (input.w >= 128) {
+                ok = equal(output, Pixel{input.x, input.y, input.z, 255});
+            } else if (nearest == -1 || nearest > max_length) {
+                ok = equal(output, input);
+            } else {
+                ok = false;
+                for (s32 sy = 0; sy < size.y; ++sy) {
+                    for (s32 sx = 0; sx < size.x; ++sx) {
+                        auto seed = source[sy*size.x + sx];
+                        if (seed.w >= 128 && get_length(sx - x, sy - y) == nearest)
+                            ok |= equal(output, Pixel{seed.x, seed.y, seed.z, 255});
+                    }
+                }
+            }
+            if (!ok) {
+                fail("'{}' at {}x{}", pipeline, x, y);
+                return;
+            }
+        }
+    }
+}
+
+// Output must not depend on how the work is split or which kernels run it.
+static void check_variants(std::vector<Pixel> &source, v2s size, char const *pipeline) {
+    set_threads(1);
+    init_kernels({SimdLevel::scalar});
+    tile_size = {};
+
+    std::vector<Pixel> expected;
+    v2s expected_size;
+    if (!run_pipeline(pipeline, source, size, expected, &expected_size)) {
+        fail("'{}' failed", pipeline);
+        return;
+    }
+
+    struct Variant {
+        s32 thread_count;
+        SimdLevel simd;
+        v2s tile;
+    };
+    Variant variants[] = {
+        {4, {SimdLevel::scalar}, {}},
+        {1, {SimdLevel::avx512}, {}},
+        {4, {SimdLevel::avx512}, {8, 8}},
+        {3, {SimdLevel::avx512}, {size.x, 1}},
+    };
+    for (auto variant : variants) {
+        set_threads(variant.thread_count);
+        init_kernels(variant.simd);
+        tile_size = variant.tile;
+
+        std::vector<Pixel> result;
+        v2s result_size;
+        if (!run_pipeline(pipeline, source, size, result, &result_size)) {
+            fail("'{}' failed", pipeline);
+            continue;
+        }
+
+        if (result_size.x != expected_size.x || result_size.y != expected_size.y || memcmp(result.data(), expected.data(), result.size()*sizeof(Pixel))) {
+            fail("'{}' with {} threads, simd {}, tile {}x{} differs from the scalar single threaded output",
+                pipeline, variant.thread_count, kernels.level, variant.tile.x, variant.tile.y);
+        }
+    }
+
+    set_threads(1);
+    init_kernels({SimdLevel::scalar});
+    tile_size = {};
+}
+
+static void test_filters() {
+    v2s size = {37, 29};
+    auto source = generate_image(size, 12345);
+
+    char const *borders[] = {"wrap", "clamp", "mirror", "transparent"};
+    for (auto border : borders) {
+        for (s32 radius : {1, 2, 5, 12})
+            check_median(source, size, radius, radius == 2 ? 25 : 50, border);
+        for (s32 radius : {1, 3, 6, 20})
+            check_kuwahara(source, size, radius, border);
+        check_morphology(source, size, "erode", 3, "square", "alpha", border);
+        check_morphology(source, size, "maxfilter", 7, "disk", "rgba", border);
+    }
+    check_morphology(source, size, "erode", 10, "disk", "rgba", "clamp");
+    check_morphology(source, size, "maxfilter", 1, "square", "alpha", "wrap");
+
+    for (auto distance : {"euclidean", "manhattan", "chebyshev"}) {
+        check_dilate(source, size, 4, distance);
+        check_dilate(source, size, 40, distance);
+    }
+
+    char const *pipelines[] = {
+        "dilate radius 6",
+        "dilate radius 10 distance chebyshev",
+        "dilate radius 8 method pushpull",
+        "median radius 3",
+        "median radius 9 percent 80 border mirror",
+        "bilateral radius 3",
+        "bilateral radius 6 border clamp",
+        "bilateral radius 4 mode gaussian",
+        "bilateral radius 8 mode grid",
+        "kuwahara radius 2",
+        "kuwahara radius 9",
+        "skidmark slices 12",
+        "skidmark slices 7 sampling bilinear blend sum",
+        "erode radius 4 shape disk channel luma",
+        "maxfilter radius 2",
+        "median radius 2 -- kuwahara radius 3 -- dilate radius 5",
+    };
+    for (auto pipeline : pipelines)
+        check_variants(source, size, pipeline);
+}
+
+static bool round_trip(std::vector<Pixel> &source, v2s size, std::filesystem::path path, char const *description) {
+    auto path_string = path.u8string();
+    Span<utf8> path_span = {(utf8 *)path_string.data(), path_string.size()};
+
+    if (save_image(path_span, source.data(), size)) {
+        fail("{}: save failed", description);
+        return false;
+    }
+
+    Image image;
+    defer { free(image); };
+    if (load_image(path_span, image)) {
+        fail("{}: load failed", description);
+        return false;
+    }
+
+    if (image.size.x != size.x || image.size.y != size.y) {
+        fail("{}: decoded {}x{}, expected {}x{}", description, image.size.x, image.size.y, size.x, size.y);
+        return false;
+    }
+    for (s32 i = 0; i < size.x*size.y; ++i) {
+        if (!equal(image.pixels[i], source[i])) {
+            fail("{}: pixel {}x{} differs", description, i % size.x, i / size.x);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Every png level and qoi must decode to the pixels that were encoded, png through stb_image.
+static void test_encoders() {
+    // Noise next to flat and repeating areas, so both literals and long matches and runs are written.
+    v2s size = {203, 97};
+    auto source = generate_image(size, 777);
+    for (s32 y = 0; y < size.y; ++y) {
+        for (s32 x = 0; x < size.x; ++x) {
+            if (x < 60)
+                source[y*size.x + x] = {10, 200, 30, 255};
+            else if (y > 50)
+                source[y*size.x + x] = source[(y % 8)*size.x + x];
+        }
+    }
+
+    auto directory = std::filesystem::temp_directory_path() / "filter_test";
+    std::filesystem::create_directories(directory);
+    defer {
+        std::error_code error;
+        std::filesystem::remove_all(directory, error);
+    };
+
+    // Each level on one thread and on several, blocks are deflated in parallel.
+    for (s32 thread_count : {1, 4}) {
+        set_threads(thread_count);
+        for (s32 level = 0; level <= 9; ++level) {
+            png_level = level;
+            char description[64];
+            snprintf(description, sizeof(description), "png level %d, %d threads", level, thread_count);
+            round_trip(source, size, directory / "image.png", description);
+        }
+        round_trip(source, size, directory / "image.qoi", "qoi");
+    }
+    png_level = 6;
+    set_threads(1);
+}
+
+// Headers claiming sizes the file can't hold must fail to load instead of allocating for them.
+static void test_corrupt_headers() {
+    auto directory = std::filesystem::temp_directory_path() / "filter_test";
+    std::filesystem::create_directories(directory);
+    defer {
+        std::error_code error;
+        std::filesystem::remove_all(directory, error);
+    };
+
+    std::string qoi_end = {0, 0, 0, 0, 0, 0, 0, 1};
+    struct File {
+        char const *name;
+        std::string bytes;
+    };
+    File files[] = {
+        {"huge.qoi", std::string("qoif\x7f\xff\xff\xff\x7f\xff\xff\xff\x04\x00", 14) + std::string(8, '\xfd') + qoi_end},
+        {"short.qoi", std::string("qoif\x00\x00\x03\xe8\x00\x00\x03\xe8\x04\x00", 14) + std::string(100, '\xfd') + qoi_end},
+        {"huge.pam", "P7\nWIDTH 2147483647\nHEIGHT 2147483647\nDEPTH 4\nMAXVAL 255\nENDHDR\n" + std::string(64, 0)},
+        {"overflow.ppm", "P6\n99999999999 3\n255\n" + std::string(64, 0)},
+        {"huge.ppm", "P6\n2147483647 2147483647\n255\n" + std::string(64, 0)},
+    };
+    for (auto &file : files) {
+        auto path = directory / file.name;
+        auto handle = fopen(path.string().c_str(), "wb");
+        fwrite(file.bytes.data(), 1, file.bytes.size(), handle);
+        fclose(handle);
+
+        auto path_string = path.u8string();
+        Image image;
+        defer { free(image); };
+        if (!load_image({(utf8 *)path_string.data(), path_string.size()}, image))
+            fail("{} loaded as {}x{}", file.name, image.size.x, image.size.y);
+    }
+}
+
+s32 tl_main(Span<Span<utf8>>) {
+    init_printer();
+    register_filters();
+
+    verbose = false;
+    set_threads(1);
+    init_kernels({SimdLevel::scalar});
+
+    test_filters();
+    test_encoders();
+    test_corrupt_headers();
+
+    free(thread_pool);
+
+    if (failure_count)
+        with(ConsoleColor::red, print("{} checks failed\n", failure_count));
+    else
+        print("All checks passed\n");
+    return failure_count;
+}
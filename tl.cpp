@@ -0,0 +1,3 @@
+// tl's implementation for the filter_api library. The programs define TL_IMPL in their own main files.
+#define TL_IMPL
+#include "filter.h"